@@ -30,6 +30,7 @@ QMAKE_CXXFLAGS += -std=c++17
 INCLUDEPATH += $$PWD/src
 #INCLUDEPATH += $$PWD/include
 #LIBS += -L $$PWD/lib -lresvg -ldl
+LIBS += -lboost_iostreams
 
 SOURCES +=  src/DirectoryListing.cpp          \
             src/ImageViewerApplication.cpp    \
@@ -49,7 +50,14 @@ SOURCES +=  src/DirectoryListing.cpp          \
             src/SingleInstanceApplication.cpp \
             src/ZoomModeDropDown.cpp          \
             src/ProtocolModule.cpp            \
-            src/resvg.cpp
+            src/resvg.cpp                     \
+            src/ImagePrefetcher.cpp           \
+            src/ImageLoader.cpp               \
+            src/TiledImage.cpp                \
+            src/AverageColor.cpp              \
+            src/SvgDocument.cpp               \
+            src/Exif.cpp                      \
+            src/FileType.cpp
 
 HEADERS += src/DirectoryListing.h          \
            src/Enums.h                     \
@@ -72,7 +80,16 @@ HEADERS += src/DirectoryListing.h          \
            src/Streams.h                   \
            src/ZoomModeDropDown.h          \
            src/ProtocolModule.h            \
-           src/resvg.hpp
+           src/resvg.hpp                   \
+           src/ImagePrefetcher.h           \
+           src/ImageCache.h                \
+           src/ImageLoader.h               \
+           src/DecodeHint.h                \
+           src/TiledImage.h                \
+           src/AverageColor.h              \
+           src/SvgDocument.h               \
+           src/Exif.h                      \
+           src/FileType.h
 
 
 FORMS += src/InfoDialog.ui        \
@@ -554,6 +554,26 @@ pub extern "C" fn resvg_options_load_system_fonts(opt: *mut resvg_options) {
     }
 }
 
+/// @brief Replaces the fonts database with a copy of another #resvg_options' one.
+///
+/// Much cheaper than loading the same fonts again.
+///
+/// Has no effect when the `text` feature is not enabled.
+#[no_mangle]
+#[allow(unused_variables)]
+pub extern "C" fn resvg_options_copy_fonts(opt: *mut resvg_options, src: *const resvg_options) {
+    #[cfg(feature = "text")]
+    {
+        let (opt, src) = unsafe {
+            assert!(!opt.is_null());
+            assert!(!src.is_null());
+            (&mut *opt, &*src)
+        };
+
+        opt.fontdb = src.fontdb.clone();
+    }
+}
+
 /// @brief Destroys the #resvg_options.
 #[no_mangle]
 pub extern "C" fn resvg_options_destroy(opt: *mut resvg_options) {
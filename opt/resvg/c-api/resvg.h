@@ -385,6 +385,15 @@ int32_t resvg_options_load_font_file(resvg_options *opt, const char *file_path);
  */
 void resvg_options_load_system_fonts(resvg_options *opt);
 
+/**
+ * @brief Replaces the fonts database with a copy of another #resvg_options' one.
+ *
+ * Much cheaper than loading the same fonts again.
+ *
+ * Has no effect when the `text` feature is not enabled.
+ */
+void resvg_options_copy_fonts(resvg_options *opt, const resvg_options *src);
+
 /**
  * @brief Destroys the #resvg_options.
  */
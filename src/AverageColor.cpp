@@ -0,0 +1,533 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "AverageColor.h"
+#include <QImage>
+#include <QtGlobal>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AVERAGECOLOR_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+//Row kernels add to sums[0..2] the sums of the first three channels of each
+//pixel, in memory order.
+typedef void (*sum_row_f)(const uchar *row, size_t pixels, quint64 *sums);
+
+struct RowKernels{
+	//4 bytes per pixel, channels taken as they are.
+	sum_row_f sum4;
+	//4 bytes per pixel, channels multiplied by the fourth byte.
+	sum_row_f sum4_weighted;
+	//3 bytes per pixel.
+	sum_row_f sum3;
+	//1 byte per pixel. Only sums[0] is used.
+	sum_row_f sum1;
+};
+
+static void sum4_scalar(const uchar *p, size_t n, quint64 *sums){
+	quint64 a = 0, b = 0, c = 0;
+	for (; n; n--, p += 4){
+		a += p[0];
+		b += p[1];
+		c += p[2];
+	}
+	sums[0] += a;
+	sums[1] += b;
+	sums[2] += c;
+}
+
+static void sum4_weighted_scalar(const uchar *p, size_t n, quint64 *sums){
+	quint64 a = 0, b = 0, c = 0;
+	for (; n; n--, p += 4){
+		a += (unsigned)p[0] * p[3];
+		b += (unsigned)p[1] * p[3];
+		c += (unsigned)p[2] * p[3];
+	}
+	sums[0] += a;
+	sums[1] += b;
+	sums[2] += c;
+}
+
+static void sum3_scalar(const uchar *p, size_t n, quint64 *sums){
+	quint64 a = 0, b = 0, c = 0;
+	for (; n; n--, p += 3){
+		a += p[0];
+		b += p[1];
+		c += p[2];
+	}
+	sums[0] += a;
+	sums[1] += b;
+	sums[2] += c;
+}
+
+static void sum1_scalar(const uchar *p, size_t n, quint64 *sums){
+	quint64 a = 0;
+	for (; n; n--)
+		a += *p++;
+	sums[0] += a;
+}
+
+#ifdef AVERAGECOLOR_X86
+
+//Byte i of masks[channel][vector] is set if byte i of that vector in a block
+//of 3-byte pixels belongs to the channel. A block is as many pixels as there
+//are bytes in a vector, so it always starts at the first channel.
+template <size_t VectorSize>
+struct Rgb888Masks{
+	alignas(32) uchar masks[3][3][VectorSize];
+
+	Rgb888Masks(){
+		for (size_t channel = 0; channel < 3; channel++)
+			for (size_t vector = 0; vector < 3; vector++)
+				for (size_t i = 0; i < VectorSize; i++)
+					this->masks[channel][vector][i] = (vector * VectorSize + i) % 3 == channel ? 0xFF : 0;
+	}
+};
+
+static const Rgb888Masks<16> rgb888_masks_128;
+static const Rgb888Masks<32> rgb888_masks_256;
+
+//Lanes of a 32-bit accumulator of products of two bytes overflow after 66051
+//additions. Each kernel flushes to 64 bits well before then.
+static const size_t flush_interval = 4096;
+
+TARGET_SSE2 static quint64 hsum_epi64(__m128i v){
+	alignas(16) quint64 t[2];
+	_mm_store_si128((__m128i *)t, v);
+	return t[0] + t[1];
+}
+
+TARGET_SSE2 static void sum4_sse2(const uchar *p, size_t n, quint64 *sums){
+	const auto zero = _mm_setzero_si128();
+	const __m128i masks[] = {
+		_mm_set1_epi32(0x000000FF),
+		_mm_set1_epi32(0x0000FF00),
+		_mm_set1_epi32(0x00FF0000),
+	};
+	__m128i acc[] = { zero, zero, zero };
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4, p += 16){
+		auto v = _mm_loadu_si128((const __m128i *)p);
+		for (int c = 0; c < 3; c++)
+			acc[c] = _mm_add_epi64(acc[c], _mm_sad_epu8(_mm_and_si128(v, masks[c]), zero));
+	}
+	for (int c = 0; c < 3; c++)
+		sums[c] += hsum_epi64(acc[c]);
+	sum4_scalar(p, n - i, sums);
+}
+
+TARGET_SSE2 static void sum4_weighted_sse2(const uchar *p, size_t n, quint64 *sums){
+	const auto zero = _mm_setzero_si128();
+	size_t i = 0;
+	while (i + 4 <= n){
+		auto block = std::min((n - i) / 4, flush_interval);
+		//Lanes hold c0*a, c1*a, c2*a, a*a.
+		auto acc = zero;
+		for (size_t j = 0; j < block; j++, p += 16){
+			auto v = _mm_loadu_si128((const __m128i *)p);
+			auto lo = _mm_unpacklo_epi8(v, zero);
+			auto hi = _mm_unpackhi_epi8(v, zero);
+			auto alpha_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			auto alpha_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			//Products of two bytes fit in 16 unsigned bits.
+			lo = _mm_mullo_epi16(lo, alpha_lo);
+			hi = _mm_mullo_epi16(hi, alpha_hi);
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(lo, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(lo, zero));
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(hi, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(hi, zero));
+		}
+		i += block * 4;
+		alignas(16) quint32 t[4];
+		_mm_store_si128((__m128i *)t, acc);
+		for (int c = 0; c < 3; c++)
+			sums[c] += t[c];
+	}
+	sum4_weighted_scalar(p, n - i, sums);
+}
+
+TARGET_SSE2 static void sum3_sse2(const uchar *p, size_t n, quint64 *sums){
+	const auto zero = _mm_setzero_si128();
+	auto &m = rgb888_masks_128.masks;
+	__m128i acc[] = { zero, zero, zero };
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16, p += 48){
+		__m128i v[] = {
+			_mm_loadu_si128((const __m128i *)p),
+			_mm_loadu_si128((const __m128i *)(p + 16)),
+			_mm_loadu_si128((const __m128i *)(p + 32)),
+		};
+		for (int c = 0; c < 3; c++)
+			for (int j = 0; j < 3; j++)
+				acc[c] = _mm_add_epi64(acc[c], _mm_sad_epu8(_mm_and_si128(v[j], _mm_load_si128((const __m128i *)m[c][j])), zero));
+	}
+	for (int c = 0; c < 3; c++)
+		sums[c] += hsum_epi64(acc[c]);
+	sum3_scalar(p, n - i, sums);
+}
+
+TARGET_SSE2 static void sum1_sse2(const uchar *p, size_t n, quint64 *sums){
+	const auto zero = _mm_setzero_si128();
+	auto acc = zero;
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16, p += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)p), zero));
+	sums[0] += hsum_epi64(acc);
+	sum1_scalar(p, n - i, sums);
+}
+
+TARGET_AVX2 static quint64 hsum256_epi64(__m256i v){
+	alignas(32) quint64 t[4];
+	_mm256_store_si256((__m256i *)t, v);
+	return t[0] + t[1] + t[2] + t[3];
+}
+
+TARGET_AVX2 static void sum4_avx2(const uchar *p, size_t n, quint64 *sums){
+	const auto zero = _mm256_setzero_si256();
+	const __m256i masks[] = {
+		_mm256_set1_epi32(0x000000FF),
+		_mm256_set1_epi32(0x0000FF00),
+		_mm256_set1_epi32(0x00FF0000),
+	};
+	__m256i acc[] = { zero, zero, zero };
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8, p += 32){
+		auto v = _mm256_loadu_si256((const __m256i *)p);
+		for (int c = 0; c < 3; c++)
+			acc[c] = _mm256_add_epi64(acc[c], _mm256_sad_epu8(_mm256_and_si256(v, masks[c]), zero));
+	}
+	for (int c = 0; c < 3; c++)
+		sums[c] += hsum256_epi64(acc[c]);
+	sum4_scalar(p, n - i, sums);
+}
+
+TARGET_AVX2 static void sum4_weighted_avx2(const uchar *p, size_t n, quint64 *sums){
+	const auto zero = _mm256_setzero_si256();
+	size_t i = 0;
+	while (i + 8 <= n){
+		auto block = std::min((n - i) / 8, flush_interval);
+		auto acc = zero;
+		for (size_t j = 0; j < block; j++, p += 32){
+			auto v = _mm256_loadu_si256((const __m256i *)p);
+			auto lo = _mm256_unpacklo_epi8(v, zero);
+			auto hi = _mm256_unpackhi_epi8(v, zero);
+			auto alpha_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			auto alpha_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			lo = _mm256_mullo_epi16(lo, alpha_lo);
+			hi = _mm256_mullo_epi16(hi, alpha_hi);
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(lo, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(lo, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(hi, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(hi, zero));
+		}
+		i += block * 8;
+		alignas(32) quint32 t[8];
+		_mm256_store_si256((__m256i *)t, acc);
+		for (int c = 0; c < 3; c++)
+			sums[c] += (quint64)t[c] + t[c + 4];
+	}
+	sum4_weighted_scalar(p, n - i, sums);
+}
+
+TARGET_AVX2 static void sum3_avx2(const uchar *p, size_t n, quint64 *sums){
+	const auto zero = _mm256_setzero_si256();
+	auto &m = rgb888_masks_256.masks;
+	__m256i acc[] = { zero, zero, zero };
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32, p += 96){
+		__m256i v[] = {
+			_mm256_loadu_si256((const __m256i *)p),
+			_mm256_loadu_si256((const __m256i *)(p + 32)),
+			_mm256_loadu_si256((const __m256i *)(p + 64)),
+		};
+		for (int c = 0; c < 3; c++)
+			for (int j = 0; j < 3; j++)
+				acc[c] = _mm256_add_epi64(acc[c], _mm256_sad_epu8(_mm256_and_si256(v[j], _mm256_load_si256((const __m256i *)m[c][j])), zero));
+	}
+	for (int c = 0; c < 3; c++)
+		sums[c] += hsum256_epi64(acc[c]);
+	sum3_scalar(p, n - i, sums);
+}
+
+TARGET_AVX2 static void sum1_avx2(const uchar *p, size_t n, quint64 *sums){
+	const auto zero = _mm256_setzero_si256();
+	auto acc = zero;
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32, p += 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)p), zero));
+	sums[0] += hsum256_epi64(acc);
+	sum1_scalar(p, n - i, sums);
+}
+
+static bool cpu_has_sse2(){
+#if defined(__x86_64__) || defined(_M_X64)
+	return true;
+#elif defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 1);
+	return info[3] & (1 << 26);
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool cpu_has_avx2(){
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	//The OS must also save the YMM registers on context switches.
+	const int osxsave = 1 << 27;
+	const int avx = 1 << 28;
+	if ((info[2] & (osxsave | avx)) != (osxsave | avx) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return info[1] & (1 << 5);
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static RowKernels select_kernels(){
+#ifdef AVERAGECOLOR_X86
+	if (cpu_has_avx2())
+		return { sum4_avx2, sum4_weighted_avx2, sum3_avx2, sum1_avx2 };
+	if (cpu_has_sse2())
+		return { sum4_sse2, sum4_weighted_sse2, sum3_sse2, sum1_sse2 };
+#endif
+	return { sum4_scalar, sum4_weighted_scalar, sum3_scalar, sum1_scalar };
+}
+
+static const RowKernels &get_kernels(){
+	static const RowKernels ret = select_kernels();
+	return ret;
+}
+
+namespace{
+
+//Sums the premultiplied channels of arbitrary spans of an image's rows.
+class ChannelSummer{
+	const QImage &src;
+	sum_row_f kernel = nullptr;
+	int bytes_per_pixel = 4;
+	//sums are multiplied by scale to put them in units of 1/255.
+	quint64 scale = 1;
+	//Byte offset of the red channel, either 0 or 2.
+	int red = 0;
+	bool gray = false;
+public:
+	ChannelSummer(const QImage &src);
+	//Formats without a kernel are converted to RGBA8888 first.
+	bool needs_conversion() const{
+		return !this->kernel;
+	}
+	quint64 get_scale() const{
+		return this->scale;
+	}
+	//Adds the sums of n pixels of row y starting at column x.
+	void sum(int y, int x, int n, quint64 *sums) const;
+	//sums must be of pixels of an image converted to RGBA8888.
+	static void sum_converted(const QImage &converted, quint64 *sums);
+	QColor to_color(const quint64 *sums, quint64 pixels) const;
+};
+
+ChannelSummer::ChannelSummer(const QImage &src): src(src){
+	auto &kernels = get_kernels();
+	switch (src.format()){
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+		case QImage::Format_RGB32:
+		case QImage::Format_ARGB32_Premultiplied:
+			this->kernel = kernels.sum4;
+			this->scale = 255;
+			this->red = 2;
+			break;
+		case QImage::Format_ARGB32:
+			this->kernel = kernels.sum4_weighted;
+			this->red = 2;
+			break;
+#endif
+		case QImage::Format_RGBX8888:
+		case QImage::Format_RGBA8888_Premultiplied:
+			this->kernel = kernels.sum4;
+			this->scale = 255;
+			break;
+		case QImage::Format_RGBA8888:
+			this->kernel = kernels.sum4_weighted;
+			break;
+		case QImage::Format_RGB888:
+			this->kernel = kernels.sum3;
+			this->bytes_per_pixel = 3;
+			this->scale = 255;
+			break;
+		case QImage::Format_BGR888:
+			this->kernel = kernels.sum3;
+			this->bytes_per_pixel = 3;
+			this->scale = 255;
+			this->red = 2;
+			break;
+		case QImage::Format_Grayscale8:
+			this->kernel = kernels.sum1;
+			this->bytes_per_pixel = 1;
+			this->scale = 255;
+			this->gray = true;
+			break;
+		default:
+			break;
+	}
+}
+
+void ChannelSummer::sum(int y, int x, int n, quint64 *sums) const{
+	if (this->kernel){
+		this->kernel(this->src.constScanLine(y) + (size_t)x * this->bytes_per_pixel, n, sums);
+		return;
+	}
+	sum_converted(this->src.copy(x, y, n, 1).convertToFormat(QImage::Format_RGBA8888), sums);
+}
+
+void ChannelSummer::sum_converted(const QImage &converted, quint64 *sums){
+	auto &kernels = get_kernels();
+	for (int y = 0; y < converted.height(); y++)
+		kernels.sum4_weighted(converted.constScanLine(y), converted.width(), sums);
+}
+
+QColor ChannelSummer::to_color(const quint64 *sums, quint64 pixels) const{
+	if (!pixels)
+		return QColor(0, 0, 0);
+	const quint64 divisor = pixels * 255;
+	int avg[3];
+	for (int c = 0; c < 3; c++)
+		avg[c] = (int)((sums[this->gray ? 0 : c] * this->scale + divisor / 2) / divisor);
+	return QColor(avg[this->red], avg[1], avg[2 - this->red]);
+}
+
+}
+
+static std::atomic<int> average_color_tolerance(1);
+
+void set_average_color_tolerance(int tolerance){
+	average_color_tolerance = std::max(tolerance, 0);
+}
+
+QColor get_average_color(const QImage &src){
+	const qint64 w = src.width();
+	const qint64 h = src.height();
+	if (w <= 0 || h <= 0)
+		return QColor(0, 0, 0);
+	ChannelSummer summer(src);
+	quint64 sums[3] = {};
+	if (summer.needs_conversion()){
+		//Converting a strip at a time avoids a second copy of the entire
+		//image.
+		const int strip = (int)std::max<qint64>((1 << 20) / w, 1);
+		for (int y = 0; y < h; y += strip)
+			ChannelSummer::sum_converted(src.copy(0, y, w, std::min<qint64>(strip, h - y)).convertToFormat(QImage::Format_RGBA8888), sums);
+	}else{
+		for (int y = 0; y < h; y++)
+			summer.sum(y, 0, w, sums);
+	}
+	return summer.to_color(sums, w * h);
+}
+
+//Images smaller than this are summed in full.
+static const qint64 min_sampled_pixels = 1 << 20;
+//Wider rows are sampled in segments.
+static const int max_row_samples = 1024;
+static const int segment_size = 256;
+//Rows sampled before the error is first estimated, and between estimates.
+static const int sample_batch = 32;
+
+//Base 2 van der Corput sequence. Taking rows in this order covers the image
+//evenly at every step, rather than from the top down.
+static quint32 radical_inverse(quint32 i){
+	i = (i << 16) | (i >> 16);
+	i = ((i & 0x00FF00FF) << 8) | ((i & 0xFF00FF00) >> 8);
+	i = ((i & 0x0F0F0F0F) << 4) | ((i & 0xF0F0F0F0) >> 4);
+	i = ((i & 0x33333333) << 2) | ((i & 0xCCCCCCCC) >> 2);
+	i = ((i & 0x55555555) << 1) | ((i & 0xAAAAAAAA) >> 1);
+	return i;
+}
+
+QColor estimate_average_color(const QImage &src){
+	return estimate_average_color(src, average_color_tolerance);
+}
+
+QColor estimate_average_color(const QImage &src, int tolerance){
+	const qint64 w = src.width();
+	const qint64 h = src.height();
+	if (tolerance <= 0 || w * h < min_sampled_pixels || h < sample_batch * 2)
+		return get_average_color(src);
+	ChannelSummer summer(src);
+
+	//Each sampled row contributes the same number of pixels, spread over
+	//segments of evenly spaced strata, so its mean is one sample of the
+	//image's mean.
+	const int segments = w > max_row_samples ? max_row_samples / segment_size : 1;
+	const int segment_width = segments > 1 ? segment_size : (int)w;
+	const qint64 stratum = w / segments;
+	const double tolerance_sums = (double)tolerance * 255 * segment_width * segments;
+
+	std::vector<bool> visited(h);
+	quint64 total[3] = {};
+	double sum_of_squares[3] = {};
+	qint64 rows = 0;
+	for (quint32 i = 0; rows < h; i++){
+		auto y = (int)(((quint64)radical_inverse(i) * h) >> 32);
+		if (visited[y])
+			continue;
+		visited[y] = true;
+		quint64 sums[3] = {};
+		for (int s = 0; s < segments; s++){
+			auto x = s * stratum;
+			if (segments > 1)
+				//Vary the offset from row to row to avoid aliasing with
+				//periodic patterns.
+				x += (radical_inverse((quint32)y * 2654435761U) * (quint64)(stratum - segment_width)) >> 32;
+			summer.sum(y, (int)x, segment_width, sums);
+		}
+		for (int c = 0; c < 3; c++){
+			total[c] += sums[c];
+			sum_of_squares[c] += (double)sums[c] * sums[c];
+		}
+		if (++rows % sample_batch)
+			continue;
+
+		//Stop once twice the standard error of the mean is within the
+		//tolerance in every channel.
+		bool done = true;
+		for (int c = 0; c < 3 && done; c++){
+			auto mean = (double)total[c] / rows;
+			auto variance = std::max(sum_of_squares[c] / rows - mean * mean, 0.0) / (rows - 1);
+			//Finite population correction.
+			variance *= 1 - (double)rows / h;
+			auto error = 2 * std::sqrt(variance) * summer.get_scale();
+			done = error <= tolerance_sums;
+		}
+		if (done)
+			break;
+	}
+	return summer.to_color(total, (quint64)rows * segment_width * segments);
+}
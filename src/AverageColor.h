@@ -0,0 +1,28 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef AVERAGECOLOR_H
+#define AVERAGECOLOR_H
+
+#include <QColor>
+
+class QImage;
+
+//Returns the mean of the image's pixels premultiplied by their alpha, so that
+//transparent pixels count as black. Common formats are read in place with
+//whichever SIMD instruction set the CPU supports; anything else is converted a
+//strip at a time.
+QColor get_average_color(const QImage &);
+//Estimates the average color from a sample of the image's rows, taking more
+//until the estimate is likely within tolerance/255 of the exact average in
+//every channel. Small images and a tolerance of 0 are summed in full. The
+//overload without a tolerance uses set_average_color_tolerance()'s.
+QColor estimate_average_color(const QImage &, int tolerance);
+QColor estimate_average_color(const QImage &);
+void set_average_color_tolerance(int);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef DECODEHINT_H
+#define DECODEHINT_H
+
+#include <QSize>
+
+//Describes how big an image is going to be displayed, so that decoders can
+//avoid producing more pixels than will be shown.
+struct DecodeHint{
+	//Empty means the image may be displayed at full resolution.
+	QSize bounds;
+	Qt::AspectRatioMode mode = Qt::KeepAspectRatio;
+	//Set when the image may be rotated 90 degrees to better fit the bounds.
+	bool any_orientation = false;
+
+	//Returns the size the image should be decoded to. Images are never
+	//enlarged.
+	QSize target_size(const QSize &full) const{
+		if (this->bounds.isEmpty() || full.isEmpty())
+			return full;
+		auto ret = full.scaled(this->bounds, this->mode);
+		if (this->any_orientation){
+			auto other = full.scaled(this->bounds.transposed(), this->mode);
+			if (other.width() > ret.width())
+				ret = other;
+		}
+		if (ret.width() >= full.width() || ret.height() >= full.height())
+			return full;
+		return ret.expandedTo(QSize(1, 1));
+	}
+};
+
+#endif
@@ -9,12 +9,33 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "Misc.h"
 #include "ImageViewerApplication.h"
 #include "ProtocolModule.h"
+#include "Exif.h"
+#include "FileType.h"
 #include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QPromise>
 #include <QtConcurrent/QtConcurrentRun>
+#include <QtConcurrent/QtConcurrentMap>
 #include <QImageReader>
 #include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <tuple>
+#include <unordered_map>
 
 const Qt::CaseSensitivity platform_case = Qt::CaseInsensitive;
+//Changes tend to come in bursts, such as while files are being copied in, so
+//the directory is scanned again this long after the first one, once for all
+//of the ones that came in the meantime. The delay isn't pushed back by later
+//changes, so that a steady stream of them can't hold off the scan for good.
+static const int rescan_delay = 250;
+//Enumerated entries are published in chunks that start this small, so that
+//the first ones arrive quickly, and double up to the maximum, so that
+//merging them into the listing takes O(n log n) overall.
+static const qsizetype first_entry_chunk = 1024;
+static const qsizetype max_entry_chunk = 1 << 16;
 
 static const char *hardcoded_supported_extensions[] = {
 	"*.bmp",
@@ -109,25 +130,196 @@ void initialize_supported_extensions(){
 #endif
 }
 
-template <Qt::CaseSensitivity CS>
-bool strcmpci(const QString &a, const QString &b){
-	return a.compare(a, b, CS) < 0;
+//Case-insensitive, with ties broken case-sensitively so that the order is
+//total and duplicates end up next to each other.
+static bool entry_less(const LocalDirectoryEntry &a, const LocalDirectoryEntry &b){
+	return std::tie(a.key, a.path) < std::tie(b.key, b.path);
 }
 
-QStringList get_local_entries(QString path){
+static bool same_entry(const LocalDirectoryEntry &a, const LocalDirectoryEntry &b){
+	return a.path == b.path;
+}
+
+static LocalDirectoryEntry make_entry(const QString &prefix, const QString &name){
+	return { prefix + name, name.toCaseFolded() };
+}
+
+static QString get_entry_prefix(const QString &path){
+	return path + QDir::separator();
+}
+
+static bool is_digit(QChar c){
+	return c >= '0' && c <= '9';
+}
+
+//Digit runs are replaced by a '0', their length, and the digits without
+//leading zeros, so that comparing the keys as they are puts numbers in order
+//of value. The '0' keeps numbers where digits would sort.
+static QString get_natural_key(const QString &key){
+	if (std::none_of(key.begin(), key.end(), is_digit))
+		return key;
+	QString ret;
+	ret.reserve(key.size() + 8);
+	for (qsizetype i = 0, n = key.size(); i < n;){
+		if (!is_digit(key[i])){
+			ret += key[i++];
+			continue;
+		}
+		while (i < n && key[i] == '0')
+			i++;
+		auto start = i;
+		while (i < n && is_digit(key[i]))
+			i++;
+		ret += QChar('0');
+		ret += QChar((char16_t)(i - start));
+		ret += QStringView(key).mid(start, i - start);
+	}
+	return ret;
+}
+
+//Ties are broken by name, so that the order is total.
+static bool sort_less(SortMode mode, const LocalDirectoryEntry &a, const LocalDirectoryEntry &b){
+	qint64 x = 0,
+		y = 0;
+	switch (mode){
+		case SortMode::Name:
+			break;
+		case SortMode::Natural:
+			if (a.natural_key != b.natural_key)
+				return a.natural_key < b.natural_key;
+			break;
+		case SortMode::ModificationTime:
+			x = a.modified;
+			y = b.modified;
+			break;
+		case SortMode::Size:
+			x = a.size;
+			y = b.size;
+			break;
+		case SortMode::CaptureTime:
+			x = a.captured;
+			y = b.captured;
+			break;
+	}
+	if (x != y)
+		return x < y;
+	return entry_less(a, b);
+}
+
+static bool needs_metadata(SortMode mode){
+	return mode == SortMode::ModificationTime || mode == SortMode::Size || mode == SortMode::CaptureTime;
+}
+
+static qint64 to_msecs(const QDateTime &t){
+	return t.isValid() ? t.toMSecsSinceEpoch() : 0;
+}
+
+static LocalFileMetadata read_metadata(const QString &path, bool capture_time){
+	QFileInfo info(path);
+	LocalFileMetadata ret{ info.size(), to_msecs(info.lastModified()), -1 };
+	if (!capture_time)
+		return ret;
+	QFile file(path);
+	QDateTime captured;
+	if (file.open(QIODevice::ReadOnly))
+		captured = get_exif_capture_time(file);
+	ret.captured = captured.isValid() ? captured.toMSecsSinceEpoch() : ret.modified;
+	return ret;
+}
+
+static QStringList get_name_filters(){
+	QStringList ret;
+	for (auto kv : supported_extensions)
+		ret << kv.first;
+	return ret;
+}
+
+static std::atomic<bool> include_extensionless_files(false);
+
+void set_include_extensionless_files(bool include){
+	include_extensionless_files = include;
+}
+
+static bool has_supported_extension(const QString &name){
+	auto dot = name.lastIndexOf('.');
+	if (dot < 0)
+		return false;
+	return supported_extensions.find("*." + name.sliced(dot + 1).toLower()) != supported_extensions.end();
+}
+
+static bool should_list(const QString &path, const QString &name, bool extensionless){
+	if (has_supported_extension(name))
+		return true;
+	if (!extensionless || name.contains('.'))
+		return false;
+	QFile file(path);
+	return file.open(QIODevice::ReadOnly) && sniff_file_type(file).kind != FileKind::Unknown;
+}
+
+//Name filters can't pick out files without an extension, so with those
+//included, everything is listed and goes through should_list() instead.
+static QStringList get_listing_filters(bool extensionless){
+	return extensionless ? QStringList() : get_name_filters();
+}
+
+//Sorted once, by key. Unlike QDir's own sorting, the keys aren't built again
+//for every comparison.
+static local_entries_t get_local_entries(QString path, bool with_metadata){
 	QDir directory(path);
 	directory.setFilter(QDir::Files | QDir::Hidden);
-	directory.setSorting(QDir::Name);
-	QStringList filters;
-	for (auto kv : supported_extensions)
-		filters << kv.first;
-	directory.setNameFilters(filters);
-	auto ret = directory.entryList();
-	auto f = strcmpci<platform_case>;
-	std::sort(ret.begin(), ret.end(), f);
+	directory.setSorting(QDir::Unsorted);
+	bool extensionless = include_extensionless_files;
+	directory.setNameFilters(get_listing_filters(extensionless));
+	auto prefix = get_entry_prefix(path);
+	local_entries_t ret;
+	if (with_metadata){
+		auto infos = directory.entryInfoList();
+		ret.reserve(infos.size());
+		for (auto &info : infos){
+			if (extensionless && !should_list(info.filePath(), info.fileName(), true))
+				continue;
+			ret.push_back(make_entry(prefix, info.fileName()));
+			ret.back().size = info.size();
+			ret.back().modified = to_msecs(info.lastModified());
+		}
+	}else{
+		auto names = directory.entryList();
+		ret.reserve(names.size());
+		for (auto &name : names)
+			if (!extensionless || should_list(prefix + name, name, true))
+				ret.push_back(make_entry(prefix, name));
+	}
+	std::sort(ret.begin(), ret.end(), entry_less);
 	return ret;
 }
 
+//Publishes the entries in sorted chunks as they're read.
+static void enumerate_local_entries(QPromise<local_entries_t> &promise, const QString &path){
+	bool extensionless = include_extensionless_files;
+	QDirIterator it(path, get_listing_filters(extensionless), QDir::Files | QDir::Hidden);
+	auto prefix = get_entry_prefix(path);
+	local_entries_t chunk;
+	auto chunk_size = first_entry_chunk;
+	auto publish = [&](){
+		std::sort(chunk.begin(), chunk.end(), entry_less);
+		promise.addResult(std::move(chunk));
+		chunk = local_entries_t();
+		chunk_size = std::min(chunk_size * 2, max_entry_chunk);
+	};
+	while (it.hasNext()){
+		if (promise.isCanceled())
+			return;
+		it.next();
+		if (extensionless && !should_list(it.filePath(), it.fileName(), true))
+			continue;
+		chunk.push_back(make_entry(prefix, it.fileName()));
+		if ((qsizetype)chunk.size() >= chunk_size)
+			publish();
+	}
+	if (!chunk.empty())
+		publish();
+}
+
 bool check_and_clean_path(QString &path){
 	QDir directory(path);
 	if (!directory.exists()){
@@ -143,7 +335,95 @@ LocalDirectoryListing::LocalDirectoryListing(const QString &path){
 	this->ok = check_and_clean_path(this->base_path);
 	if (!this->ok)
 		return;
-	this->entries = QtConcurrent::run(get_local_entries, path);
+	this->entries = QtConcurrent::run(enumerate_local_entries, this->base_path);
+	this->rescan_timer.setSingleShot(true);
+	this->rescan_timer.setInterval(rescan_delay);
+	QObject::connect(&this->watcher, &QFileSystemWatcher::directoryChanged, &this->rescan_timer, [this](){
+		if (!this->rescan_timer.isActive())
+			this->rescan_timer.start();
+	});
+	QObject::connect(&this->rescan_timer, &QTimer::timeout, [this](){
+		this->start_rescan();
+	});
+	this->watcher.addPath(this->base_path);
+}
+
+LocalDirectoryListing::~LocalDirectoryListing(){
+	this->entries.cancel();
+	this->metadata.cancel();
+}
+
+void LocalDirectoryListing::refresh(){
+	if (this->complete)
+		return;
+	//Everything is published before the enumeration finishes.
+	bool finished = this->entries.isFinished();
+	auto count = this->entries.resultCount();
+	if (this->merged_chunks < count){
+		for (; this->merged_chunks < count; this->merged_chunks++){
+			auto chunk = this->entries.resultAt(this->merged_chunks);
+			auto old_size = this->list.size();
+			this->list.insert(this->list.end(), chunk.begin(), chunk.end());
+			std::inplace_merge(this->list.begin(), this->list.begin() + old_size, this->list.end(), entry_less);
+		}
+		//Entries found ahead of time by find() show up again.
+		this->list.erase(std::unique(this->list.begin(), this->list.end(), same_entry), this->list.end());
+		this->reorder();
+		this->version++;
+		this->gather_metadata();
+	}
+	if (finished)
+		this->complete = true;
+}
+
+void LocalDirectoryListing::sync(){
+	this->entries.waitForFinished();
+	this->refresh();
+}
+
+void LocalDirectoryListing::start_rescan(){
+	//The watcher only says that something changed, not what, so the whole
+	//directory is listed again. One scan at a time; whatever changes in the
+	//meantime is picked up by the next one.
+	if (this->rescanning){
+		this->rescan_pending = true;
+		return;
+	}
+	this->rescanning = true;
+	QtConcurrent::run(get_local_entries, this->base_path, needs_metadata(this->sort_mode)).then(&this->watcher, [this](local_entries_t entries){
+		this->rescan_finished(entries);
+	});
+}
+
+void LocalDirectoryListing::rescan_finished(local_entries_t &entries){
+	this->rescanning = false;
+	//This supersedes the initial enumeration, if it's still going.
+	this->entries.cancel();
+	this->complete = true;
+	//Metadata only counts if the scan read it.
+	auto same = [](const LocalDirectoryEntry &a, const LocalDirectoryEntry &b){
+		return a.path == b.path && (b.size < 0 || (a.size == b.size && a.modified == b.modified));
+	};
+	if (!std::equal(this->list.begin(), this->list.end(), entries.begin(), entries.end(), same)){
+		//Capture times are only read again for files that changed.
+		std::unordered_map<QString, const LocalDirectoryEntry *> old;
+		for (auto &entry : this->list)
+			if (entry.captured >= 0)
+				old[entry.path] = &entry;
+		for (auto &entry : entries){
+			auto it = old.find(entry.path);
+			if (it != old.end() && it->second->size == entry.size && it->second->modified == entry.modified)
+				entry.captured = it->second->captured;
+		}
+		this->list = std::move(entries);
+		this->reorder();
+		this->version++;
+		this->gather_metadata();
+	}
+	if (this->rescan_pending){
+		this->rescan_pending = false;
+		this->start_rescan();
+	}
 }
 
 bool LocalDirectoryListing::operator==(const QString &path){
@@ -155,32 +435,186 @@ DirectoryIterator DirectoryListing::begin(){
 }
 
 size_t LocalDirectoryListing::size(){
-	return this->entries.result().size();
+	return this->list.size();
 }
 
 QString LocalDirectoryListing::operator[](size_t i){
-	auto ret = this->base_path;
-	ret += QDir::separator();
-	ret += this->entries.result()[i];
-	return ret;
+	return this->list[this->get_index(i)].path;
 }
 
 bool LocalDirectoryListing::find(size_t &dst, const QString &s){
-	auto f = strcmpci<platform_case>;
-	auto entries = this->entries.result();
-	auto it = std::lower_bound(entries.begin(), entries.end(), s, f);
-	if (it == entries.end())
+	//The keys are already folded, so comparing case-insensitively folds only
+	//s, a character at a time, without allocating.
+	auto &entries = this->list;
+	auto it = std::lower_bound(entries.begin(), entries.end(), s, [](const LocalDirectoryEntry &e, const QString &s){
+		return QString::compare(e.key, s, platform_case) < 0;
+	});
+	size_t i = it - entries.begin();
+	if (it != entries.end() && !QString::compare(it->key, s, platform_case)){
+		dst = this->get_position(i);
+		return true;
+	}
+	//Where s would be is only known by name.
+	if (this->sort_mode == SortMode::Name)
+		dst = i;
+	//While the directory is still being enumerated, a file that's known to
+	//be in it is added ahead of time, so that navigation can start from it.
+	if (this->complete)
 		return false;
-	qDebug() << s;
-	qDebug() << *it;
-	if (f(s, *it))
+	auto entry = make_entry(get_entry_prefix(this->base_path), s);
+	if (!should_list(entry.path, s, include_extensionless_files) || !QFileInfo::exists(entry.path))
 		return false;
-	dst = it - entries.begin();
+	entries.insert(it, std::move(entry));
+	this->reorder();
+	this->version++;
+	this->gather_metadata();
+	dst = this->get_position(i);
 	return true;
 }
 
 QString LocalDirectoryListing::get_filename(size_t i){
-	return this->entries.result()[i];
+	return this->list[this->get_index(i)].path.sliced(this->base_path.size() + 1);
+}
+
+size_t LocalDirectoryListing::get_index(size_t position) const{
+	return this->sort_mode == SortMode::Name ? position : this->order[position];
+}
+
+size_t LocalDirectoryListing::get_position(size_t index) const{
+	return this->sort_mode == SortMode::Name ? index : this->positions[index];
+}
+
+void LocalDirectoryListing::set_sort_mode(SortMode mode){
+	if (mode == this->sort_mode)
+		return;
+	this->sort_mode = mode;
+	this->reorder();
+	this->version++;
+	this->gather_metadata();
+}
+
+void LocalDirectoryListing::reorder(){
+	auto &list = this->list;
+	auto mode = this->sort_mode;
+	if (mode == SortMode::Name){
+		this->order.clear();
+		this->positions.clear();
+		return;
+	}
+	if (mode == SortMode::Natural)
+		for (auto &entry : list)
+			if (entry.natural_key.isNull())
+				entry.natural_key = get_natural_key(entry.key);
+	this->order.resize(list.size());
+	std::iota(this->order.begin(), this->order.end(), (size_t)0);
+	std::sort(this->order.begin(), this->order.end(), [&list, mode](size_t a, size_t b){
+		return sort_less(mode, list[a], list[b]);
+	});
+	this->positions.resize(list.size());
+	for (size_t i = 0; i < this->order.size(); i++)
+		this->positions[this->order[i]] = i;
+}
+
+void LocalDirectoryListing::gather_metadata(){
+	//Whatever is missing when this finishes is gathered next.
+	if (this->gathering || !needs_metadata(this->sort_mode))
+		return;
+	bool capture_time = this->sort_mode == SortMode::CaptureTime;
+	QStringList paths;
+	for (auto &entry : this->list)
+		if (entry.size < 0 || (capture_time && entry.captured < 0))
+			paths << entry.path;
+	if (paths.isEmpty())
+		return;
+	this->gathering = true;
+	this->metadata = QtConcurrent::mapped(paths, [capture_time](const QString &path){
+		return read_metadata(path, capture_time);
+	});
+	this->metadata.then(&this->watcher, [this, paths](QFuture<LocalFileMetadata> future){
+		this->metadata_finished(paths, future.results());
+	});
+}
+
+void LocalDirectoryListing::metadata_finished(const QStringList &paths, const QList<LocalFileMetadata> &results){
+	this->gathering = false;
+	//The list may have changed in the meantime.
+	std::unordered_map<QString, const LocalFileMetadata *> found;
+	for (qsizetype i = 0; i < results.size(); i++)
+		found[paths[i]] = &results[i];
+	for (auto &entry : this->list){
+		auto it = found.find(entry.path);
+		if (it == found.end())
+			continue;
+		entry.size = it->second->size;
+		entry.modified = it->second->modified;
+		if (it->second->captured >= 0)
+			entry.captured = it->second->captured;
+	}
+	this->reorder();
+	this->version++;
+	this->gather_metadata();
+}
+
+void DirectoryIterator::remember(){
+	this->version = this->dl->get_version();
+	this->removed = false;
+	//Only local listings ever change.
+	if (this->dl->is_local() && this->position < this->dl->size())
+		this->current = this->dl->get_filename(this->position);
+}
+
+void DirectoryIterator::follow_changes() const{
+	this->dl->refresh();
+	auto version = this->dl->get_version();
+	if (version == this->version)
+		return;
+	this->version = version;
+	//If the entry is gone and the listing can't say where it would be, the
+	//one that took its place is the best guess.
+	size_t i = this->position;
+	this->removed = !this->dl->find(i, this->current);
+	this->position = i < this->dl->size() ? i : 0;
+}
+
+bool DirectoryIterator::advance_to(const QString &name){
+	this->follow_changes();
+	if (this->in_position)
+		return true;
+	size_t i;
+	if (!this->dl->find(i, name))
+		return false;
+	this->position = i;
+	this->in_position = true;
+	this->remember();
+	return true;
+}
+
+void DirectoryIterator::operator++(){
+	this->follow_changes();
+	auto n = this->dl->size();
+	if (!n)
+		return;
+	//If the current entry was removed, position already is the next one.
+	if (!this->removed)
+		this->position = (this->position + 1) % n;
+	this->remember();
+}
+
+void DirectoryIterator::operator--(){
+	this->follow_changes();
+	auto n = this->dl->size();
+	if (!n)
+		return;
+	this->position = (this->position + n - 1) % n;
+	this->remember();
+}
+
+void DirectoryIterator::to_start(){
+	//Which entry is first isn't known until the whole directory is read.
+	this->dl->sync();
+	this->follow_changes();
+	this->position = 0;
+	this->remember();
 }
 
 ProtocolDirectoryListing::list_t ProtocolDirectoryListing::get_protocol_entries(QString path, ProtocolDirectoryListing *listing, CustomProtocolHandler *handler){
@@ -9,15 +9,22 @@ Distributed under a permissive license. See COPYING.txt for details.
 #define DIRECTORYLISTING_H
 
 #include "ProtocolModule.h"
+#include "Enums.h"
 #include <QString>
 #include <QStringList>
 #include <QFuture>
+#include <QFileSystemWatcher>
+#include <QTimer>
 #include <vector>
+#include <cstdint>
 #include <QtCore/qatomic.h>
 #include <memory>
 #include <unordered_map>
 
 void initialize_supported_extensions();
+//Whether files without an extension are looked into, and listed if they're
+//images.
+void set_include_extensionless_files(bool);
 class DirectoryIterator;
 
 bool check_and_clean_path(QString &path);
@@ -27,12 +34,15 @@ protected:
 	bool ok;
 	QString base_path;
 	QFuture<QStringList> entries;
+	//Incremented whenever the entries change.
+	std::uint64_t version = 0;
 public:
 	virtual ~DirectoryListing(){}
 	DirectoryIterator begin();
 	virtual size_t size() = 0;
 	virtual QString operator[](size_t) = 0;
-	virtual bool find(size_t &, const QString &) = 0;
+	//On failure, dst may be set to the position s would be at.
+	virtual bool find(size_t &dst, const QString &s) = 0;
 	operator bool() const{
 		return this->ok;
 	}
@@ -42,14 +52,75 @@ public:
 	virtual QString get_unique_filename(size_t i){
 		return this->get_filename(i);
 	}
+	//Waits for the entries to be enumerated.
 	virtual void sync(){}
+	//Returns false while the entries are still being enumerated.
+	virtual bool is_ready() const = 0;
+	//Takes in whatever has been enumerated since the last call. Entries are
+	//otherwise left alone, so that positions stay valid between calls.
+	virtual void refresh(){}
+	//Listings that can only be in one order ignore this.
+	virtual void set_sort_mode(SortMode){}
+	std::uint64_t get_version() const{
+		return this->version;
+	}
+};
+
+struct LocalDirectoryEntry{
+	QString path;
+	//The case folded name. Entries are sorted by it, so that lookups compare
+	//strings as they are rather than folding them every time.
+	QString key;
+	//The rest are filled in once a sort mode needs them, and stay negative or
+	//null until then.
+	QString natural_key;
+	qint64 size = -1;
+	//In milliseconds since the epoch.
+	qint64 modified = -1;
+	qint64 captured = -1;
+};
+
+struct LocalFileMetadata{
+	qint64 size;
+	qint64 modified;
+	//Negative if it wasn't asked for.
+	qint64 captured;
 };
 
+typedef std::vector<LocalDirectoryEntry> local_entries_t;
+
+//Usable while the directory is still being enumerated, and follows changes
+//to it for as long as it's open.
 class LocalDirectoryListing : public DirectoryListing{
-	QFuture<QStringList> entries;
+	//Sorted chunks, published as they're enumerated.
+	QFuture<local_entries_t> entries;
+	int merged_chunks = 0;
+	//Set once every entry is in list.
+	bool complete = false;
+	local_entries_t list;
+	QFileSystemWatcher watcher;
+	QTimer rescan_timer;
+	bool rescanning = false;
+	bool rescan_pending = false;
+	//list is always sorted by name. Other orders are kept as an index into it,
+	//along with the inverse, so that switching modes only sorts the index.
+	SortMode sort_mode = SortMode::Name;
+	std::vector<size_t> order;
+	std::vector<size_t> positions;
+	QFuture<LocalFileMetadata> metadata;
+	bool gathering = false;
+
+	void start_rescan();
+	void rescan_finished(local_entries_t &);
+	size_t get_index(size_t position) const;
+	size_t get_position(size_t index) const;
+	void reorder();
+	void gather_metadata();
+	void metadata_finished(const QStringList &paths, const QList<LocalFileMetadata> &);
 public:
 	LocalDirectoryListing(const QString &path, CustomProtocolHandler &): LocalDirectoryListing(path){}
 	LocalDirectoryListing(const QString &path);
+	~LocalDirectoryListing();
 	size_t size() override;
 	QString operator[](size_t) override;
 	bool find(size_t &, const QString &) override;
@@ -58,6 +129,12 @@ public:
 		return true;
 	}
 	QString get_filename(size_t) override;
+	bool is_ready() const override{
+		return this->entries.isFinished();
+	}
+	void sync() override;
+	void refresh() override;
+	void set_sort_mode(SortMode) override;
 };
 
 class ProtocolDirectoryListing : public DirectoryListing{
@@ -85,38 +162,42 @@ public:
 	QString get_filename(size_t) override;
 	QString get_unique_filename(size_t i) override;
 	void sync() override;
+	bool is_ready() const override{
+		return this->future.isFinished();
+	}
 };
 
 class DirectoryIterator{
 	DirectoryListing *dl;
-	size_t position;
+	mutable size_t position;
 	bool in_position;
+	//The entry at position as of version of the listing, so that it can be
+	//found again if the listing changes.
+	mutable QString current;
+	mutable std::uint64_t version;
+	//Set when the current entry was removed. position is then the entry that
+	//followed it.
+	mutable bool removed = false;
+
+	void remember();
+	void follow_changes() const;
 public:
-	DirectoryIterator(DirectoryListing &dl): dl(&dl), position(0), in_position(false){}
-	bool advance_to(const QString &name){
-		if (this->in_position)
-			return true;
-		return this->in_position = this->dl->find(this->position, name);
-	}
+	DirectoryIterator(DirectoryListing &dl): dl(&dl), position(0), in_position(false), version(dl.get_version()){}
+	bool advance_to(const QString &name);
 	QString operator*() const{
+		this->follow_changes();
 		return (*this->dl)[this->position];
 	}
-	void operator++(){
-		this->position = (this->position + 1) % this->dl->size();
-	}
-	void operator--(){
-		auto n = this->dl->size();
-		this->position = (this->position + n - 1) % n;
-	}
+	void operator++();
+	void operator--();
 	DirectoryListing *get_listing() const{
 		return this->dl;
 	}
 	size_t pos() const{
+		this->follow_changes();
 		return this->position;
 	}
-	void to_start(){
-		this->position = 0;
-	}
+	void to_start();
 	void to_end(){
 		this->to_start();
 		--*this;
@@ -126,6 +207,7 @@ public:
 	}
 	QString get_directory();
 	QString get_current_filename() const{
+		this->follow_changes();
 		return this->dl->get_unique_filename(this->position);
 	}
 };
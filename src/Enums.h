@@ -19,4 +19,15 @@ enum class ZoomMode {
 	AutoRotFill       = AutomaticRotation | AutomaticZoom | 1,
 };
 
+//The order in which the files in a directory are gone through.
+enum class SortMode {
+	Name             = 0,
+	//Numbers in names compare by value, so that "2" comes before "10".
+	Natural          = 1,
+	ModificationTime = 2,
+	Size             = 3,
+	//From the EXIF tags, or the modification time if there are none.
+	CaptureTime      = 4,
+};
+
 #endif
@@ -0,0 +1,161 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "Exif.h"
+#include <QIODevice>
+#include <cstdint>
+#include <cstring>
+
+static const std::uint16_t tag_date_time = 0x0132;
+static const std::uint16_t tag_exif_ifd = 0x8769;
+static const std::uint16_t tag_date_time_original = 0x9003;
+static const std::uint16_t tag_date_time_digitized = 0x9004;
+static const std::uint16_t type_ascii = 2;
+static const std::uint16_t type_long = 4;
+static const std::uint16_t type_ifd = 13;
+//"YYYY:MM:DD HH:MM:SS" and the terminator.
+static const std::uint32_t date_time_length = 20;
+//Anything bigger than this is a corrupt IFD.
+static const std::uint16_t max_ifd_entries = 1024;
+
+namespace{
+
+//Reads from TIFF data starting at base, which is where the offsets in it are
+//relative to.
+class TiffReader{
+	QIODevice *dev;
+	qint64 base;
+	bool big_endian = false;
+public:
+	TiffReader(QIODevice &dev, qint64 base): dev(&dev), base(base){}
+	bool read(std::uint32_t offset, void *dst, qint64 n){
+		return this->dev->seek(this->base + offset) && this->dev->read((char *)dst, n) == n;
+	}
+	bool read16(std::uint32_t offset, std::uint16_t &dst){
+		unsigned char buffer[2];
+		if (!this->read(offset, buffer, sizeof(buffer)))
+			return false;
+		dst = (std::uint16_t)(this->big_endian ?
+			buffer[0] << 8 | buffer[1] :
+			buffer[1] << 8 | buffer[0]);
+		return true;
+	}
+	bool read32(std::uint32_t offset, std::uint32_t &dst){
+		std::uint16_t a, b;
+		if (!this->read16(offset, a) || !this->read16(offset + 2, b))
+			return false;
+		dst = this->big_endian ?
+			(std::uint32_t)a << 16 | b :
+			(std::uint32_t)b << 16 | a;
+		return true;
+	}
+	//Returns the offset of the first IFD.
+	bool read_header(std::uint32_t &ifd){
+		char header[4];
+		if (!this->read(0, header, sizeof(header)))
+			return false;
+		if (!memcmp(header, "II*\0", 4))
+			this->big_endian = false;
+		else if (!memcmp(header, "MM\0*", 4))
+			this->big_endian = true;
+		else
+			return false;
+		return this->read32(4, ifd);
+	}
+	//Returns the offset of the entry for the tag, and its type.
+	bool find_tag(std::uint32_t ifd, std::uint16_t tag, std::uint32_t &entry, std::uint16_t &type){
+		std::uint16_t count;
+		if (!this->read16(ifd, count) || count > max_ifd_entries)
+			return false;
+		for (std::uint16_t i = 0; i < count; i++){
+			entry = ifd + 2 + i * 12;
+			std::uint16_t entry_tag;
+			if (!this->read16(entry, entry_tag))
+				return false;
+			//Entries are sorted by tag.
+			if (entry_tag > tag)
+				return false;
+			if (entry_tag < tag)
+				continue;
+			return this->read16(entry + 2, type);
+		}
+		return false;
+	}
+	QDateTime read_date_time(std::uint32_t ifd, std::uint16_t tag){
+		std::uint32_t entry, count, offset;
+		std::uint16_t type;
+		if (!this->find_tag(ifd, tag, entry, type) || type != type_ascii)
+			return {};
+		if (!this->read32(entry + 4, count) || count < date_time_length - 1)
+			return {};
+		if (!this->read32(entry + 8, offset))
+			return {};
+		char buffer[date_time_length - 1];
+		if (!this->read(offset, buffer, sizeof(buffer)))
+			return {};
+		//Cameras that don't know the time write blanks or zeroes, which
+		//don't parse.
+		return QDateTime::fromString(QString::fromLatin1(buffer, sizeof(buffer)), "yyyy:MM:dd HH:mm:ss");
+	}
+};
+
+}
+
+static QDateTime get_tiff_capture_time(QIODevice &dev, qint64 base){
+	TiffReader reader(dev, base);
+	std::uint32_t ifd0, entry, exif_ifd;
+	std::uint16_t type;
+	if (!reader.read_header(ifd0))
+		return {};
+	if (reader.find_tag(ifd0, tag_exif_ifd, entry, type) && (type == type_long || type == type_ifd) && reader.read32(entry + 8, exif_ifd)){
+		for (auto tag : { tag_date_time_original, tag_date_time_digitized }){
+			auto ret = reader.read_date_time(exif_ifd, tag);
+			if (ret.isValid())
+				return ret;
+		}
+	}
+	//When the file was last edited, which is the best there is without the
+	//others.
+	return reader.read_date_time(ifd0, tag_date_time);
+}
+
+static QDateTime get_jpeg_capture_time(QIODevice &dev){
+	//The EXIF data is in an APP1 segment, which comes before the image data.
+	qint64 position = 2;
+	while (true){
+		unsigned char header[4];
+		if (!dev.seek(position) || dev.read((char *)header, sizeof(header)) != sizeof(header) || header[0] != 0xFF)
+			return {};
+		auto marker = header[1];
+		//Fill bytes.
+		if (marker == 0xFF){
+			position++;
+			continue;
+		}
+		//Start of scan, or end of image.
+		if (marker == 0xDA || marker == 0xD9)
+			return {};
+		int length = header[2] << 8 | header[3];
+		if (length < 2)
+			return {};
+		if (marker == 0xE1){
+			char id[6];
+			if (dev.read(id, sizeof(id)) == sizeof(id) && !memcmp(id, "Exif\0\0", sizeof(id)))
+				return get_tiff_capture_time(dev, position + 4 + sizeof(id));
+		}
+		position += 2 + length;
+	}
+}
+
+QDateTime get_exif_capture_time(QIODevice &dev){
+	unsigned char magic[2];
+	if (!dev.seek(0) || dev.read((char *)magic, sizeof(magic)) != sizeof(magic))
+		return {};
+	if (magic[0] == 0xFF && magic[1] == 0xD8)
+		return get_jpeg_capture_time(dev);
+	return get_tiff_capture_time(dev, 0);
+}
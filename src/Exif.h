@@ -0,0 +1,20 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef EXIF_H
+#define EXIF_H
+
+#include <QDateTime>
+
+class QIODevice;
+
+//Returns when the picture in a JPEG or TIFF file was taken, according to its
+//EXIF tags, or an invalid QDateTime if it doesn't say. Only the headers are
+//read. The device must be random access.
+QDateTime get_exif_capture_time(QIODevice &);
+
+#endif
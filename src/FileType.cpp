@@ -0,0 +1,190 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "FileType.h"
+#include <QIODevice>
+#include <QFileInfo>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <cctype>
+#include <cstring>
+
+//Enough for every signature below, and for the root element of most SVGs.
+static const qint64 sniff_size = 512;
+
+struct Signature{
+	qsizetype offset;
+	const char *magic;
+	qsizetype size;
+	FileKind kind;
+	const char *format;
+};
+
+#define SIGNATURE(offset, magic, kind, format) { offset, magic, sizeof(magic) - 1, FileKind::kind, format }
+
+static const Signature signatures[] = {
+	SIGNATURE(0, "\xFF\xD8\xFF",          Image,     "jpeg"),
+	SIGNATURE(0, "\x89PNG\r\n\x1A\n",     Image,     "png"),
+	SIGNATURE(0, "\x8AMNG\r\n\x1A\n",     Animation, "mng"),
+	SIGNATURE(0, "GIF87a",                Animation, "gif"),
+	SIGNATURE(0, "GIF89a",                Animation, "gif"),
+	SIGNATURE(0, "II*\0",                 Image,     "tiff"),
+	SIGNATURE(0, "MM\0*",                 Image,     "tiff"),
+	SIGNATURE(0, "/* XPM */",             Image,     "xpm"),
+	SIGNATURE(0, "BM",                    Image,     "bmp"),
+};
+
+static bool has_magic(const QByteArray &head, qsizetype offset, const char *magic, qsizetype size){
+	return head.size() >= offset + size && !memcmp(head.constData() + offset, magic, size);
+}
+
+static FileType sniff_webp(const QByteArray &head){
+	//Only the extended format can be animated, and it says so in its flags.
+	const qsizetype flags = 20;
+	bool animated = has_magic(head, 12, "VP8X", 4) && head.size() > flags && (head[flags] & 0x02);
+	return { animated ? FileKind::Animation : FileKind::Image, "webp" };
+}
+
+static unsigned read_le(const QByteArray &head, qsizetype offset, int bytes){
+	unsigned ret = 0;
+	for (int i = bytes; i--;)
+		ret = ret << 8 | (unsigned char)head[offset + i];
+	return ret;
+}
+
+//Four bytes aren't enough to go by. The most common kind of TGA, for one,
+//starts with the same ones as a cursor, so the first directory entry has to
+//make sense as well.
+static FileType sniff_ico(const QByteArray &head){
+	const qsizetype header = 6;
+	const qsizetype entry = 16;
+	if (head.size() < header + entry || read_le(head, 0, 2) != 0)
+		return {};
+	auto type = read_le(head, 2, 2);
+	auto count = read_le(head, 4, 2);
+	if ((type != 1 && type != 2) || !count)
+		return {};
+	//Reserved.
+	if (head[header + 3])
+		return {};
+	if (type == 1){
+		auto planes = read_le(head, header + 4, 2);
+		auto bits = read_le(head, header + 6, 2);
+		if (planes > 1 || (bits && bits != 1 && bits != 4 && bits != 8 && bits != 16 && bits != 24 && bits != 32))
+			return {};
+	}
+	auto size = read_le(head, header + 8, 4);
+	auto offset = read_le(head, header + 12, 4);
+	if (!size || (qsizetype)offset < header + entry * (qsizetype)count)
+		return {};
+	return { FileKind::Image, type == 1 ? "ico" : "cur" };
+}
+
+static FileType sniff_netpbm(const QByteArray &head){
+	static const char *formats[] = { "pbm", "pgm", "ppm" };
+	if (head.size() < 3 || head[0] != 'P' || head[1] < '1' || head[1] > '6' || !isspace((unsigned char)head[2]))
+		return {};
+	return { FileKind::Image, formats[(head[1] - '1') % 3] };
+}
+
+//Returns the position right after the first end found from i on, or -1.
+static qsizetype skip_past(const QByteArray &head, qsizetype i, const char *end){
+	auto found = head.indexOf(end, i);
+	return found < 0 ? -1 : found + (qsizetype)strlen(end);
+}
+
+//A doctype can have an internal subset in brackets, which may contain '>'.
+static qsizetype skip_doctype(const QByteArray &head, qsizetype i){
+	bool subset = false;
+	for (; i < head.size(); i++){
+		if (head[i] == '[')
+			subset = true;
+		else if (head[i] == ']')
+			subset = false;
+		else if (head[i] == '>' && !subset)
+			return i + 1;
+	}
+	return -1;
+}
+
+static bool is_svg(const QByteArray &head){
+	qsizetype i = has_magic(head, 0, "\xEF\xBB\xBF", 3) ? 3 : 0;
+	//The root element may come after a declaration, a doctype, processing
+	//instructions and comments, but nothing else.
+	while (true){
+		while (i < head.size() && isspace((unsigned char)head[i]))
+			i++;
+		if (has_magic(head, i, "<?", 2))
+			i = skip_past(head, i + 2, "?>");
+		else if (has_magic(head, i, "<!--", 4))
+			i = skip_past(head, i + 4, "-->");
+		else if (has_magic(head, i, "<!DOCTYPE", 9))
+			i = skip_doctype(head, i + 9);
+		else
+			break;
+		if (i < 0)
+			return false;
+	}
+	if (!has_magic(head, i, "<svg", 4))
+		return false;
+	i += 4;
+	return i < head.size() && (isspace((unsigned char)head[i]) || head[i] == '>' || head[i] == '/');
+}
+
+//What the head of a gzipped file inflates to, as far as it can be inflated
+//without the rest of the file.
+static QByteArray inflate_head(const QByteArray &head){
+	boost::iostreams::filtering_istream stream;
+	stream.push(boost::iostreams::gzip_decompressor());
+	stream.push(boost::iostreams::array_source(head.constData(), (size_t)head.size()));
+	QByteArray ret(sniff_size, 0);
+	try{
+		stream.read(ret.data(), ret.size());
+	}catch (std::exception &){
+		return {};
+	}
+	ret.resize(stream.gcount());
+	return ret;
+}
+
+FileType sniff_file_type(QIODevice &dev){
+	return sniff_file_type(dev.peek(sniff_size));
+}
+
+FileType sniff_file_type(const QByteArray &head){
+	for (auto &signature : signatures)
+		if (has_magic(head, signature.offset, signature.magic, signature.size))
+			return { signature.kind, signature.format };
+	if (has_magic(head, 0, "RIFF", 4) && has_magic(head, 8, "WEBP", 4))
+		return sniff_webp(head);
+	//Compressed SVG is the only gzipped format there is support for, but
+	//that's no reason to take any gzipped file for one. If what's inside
+	//can't be told, the extension gets the final say.
+	if (has_magic(head, 0, "\x1F\x8B", 2)){
+		if (is_svg(inflate_head(head)))
+			return { FileKind::Svg, {} };
+		return {};
+	}
+	for (auto sniff : { sniff_ico, sniff_netpbm }){
+		auto ret = sniff(head);
+		if (ret.kind != FileKind::Unknown)
+			return ret;
+	}
+	if (is_svg(head))
+		return { FileKind::Svg, {} };
+	return {};
+}
+
+FileType guess_file_type(const QString &filename){
+	auto extension = QFileInfo(filename).suffix().toLower();
+	if (extension == "svg" || extension == "svgz")
+		return { FileKind::Svg, {} };
+	if (extension == "gif" || extension == "webp")
+		return { FileKind::Animation, extension.toLatin1() };
+	return { FileKind::Image, extension.toLatin1() };
+}
@@ -0,0 +1,38 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef FILETYPE_H
+#define FILETYPE_H
+
+#include <QByteArray>
+#include <QString>
+
+class QIODevice;
+
+enum class FileKind{
+	Unknown,
+	Image,
+	//Possibly animated. QMovie gets the first try.
+	Animation,
+	Svg,
+};
+
+struct FileType{
+	FileKind kind = FileKind::Unknown;
+	//For QImageReader and QMovie. Empty if it's up to them to work it out.
+	QByteArray format;
+};
+
+//Identifies the file from its first few hundred bytes. They're peeked rather
+//than read, so whatever decodes the file next gets them from the device's
+//buffer.
+FileType sniff_file_type(QIODevice &);
+FileType sniff_file_type(const QByteArray &head);
+//For when the contents say nothing, or can't be looked at.
+FileType guess_file_type(const QString &filename);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <QString>
+#include <QtGlobal>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+//Identifies a particular version of a file. For URLs, only the URL is known,
+//so timestamp and size are left at -1.
+struct FileIdentity{
+	QString path;
+	qint64 timestamp = -1;
+	qint64 size = -1;
+
+	bool operator<(const FileIdentity &other) const{
+		return std::tie(this->path, this->timestamp, this->size) < std::tie(other.path, other.timestamp, other.size);
+	}
+};
+
+//Thread-safe LRU cache that evicts the least recently used entries once the
+//total cost of its entries exceeds a budget (in bytes).
+template <typename K, typename V>
+class ByteBudgetCache{
+	struct Entry{
+		V value;
+		size_t cost;
+		typename std::list<K>::iterator position;
+	};
+	mutable std::mutex mutex;
+	size_t budget;
+	size_t used = 0;
+	//Front is the most recently used.
+	std::list<K> order;
+	std::map<K, Entry> entries;
+
+	//Values are moved out into garbage, so that callers can destroy them
+	//after the lock has been released.
+	void remove(typename std::map<K, Entry>::iterator it, std::vector<V> &garbage){
+		garbage.emplace_back(std::move(it->second.value));
+		this->used -= it->second.cost;
+		this->order.erase(it->second.position);
+		this->entries.erase(it);
+	}
+	void evict(std::vector<V> &garbage){
+		while (this->used > this->budget && this->order.size())
+			this->remove(this->entries.find(this->order.back()), garbage);
+	}
+public:
+	ByteBudgetCache(size_t budget = 0): budget(budget){}
+	ByteBudgetCache(const ByteBudgetCache &) = delete;
+	ByteBudgetCache &operator=(const ByteBudgetCache &) = delete;
+	void set_budget(size_t budget){
+		std::vector<V> garbage;
+		std::lock_guard<std::mutex> lg(this->mutex);
+		this->budget = budget;
+		this->evict(garbage);
+	}
+	//Returns a default-constructed V on a miss.
+	V get(const K &key){
+		std::lock_guard<std::mutex> lg(this->mutex);
+		auto it = this->entries.find(key);
+		if (it == this->entries.end())
+			return {};
+		this->order.splice(this->order.begin(), this->order, it->second.position);
+		return it->second.value;
+	}
+	void put(const K &key, V value, size_t cost){
+		std::vector<V> garbage;
+		std::lock_guard<std::mutex> lg(this->mutex);
+		auto it = this->entries.find(key);
+		if (it != this->entries.end())
+			this->remove(it, garbage);
+		//Don't flush the entire cache for something that won't fit anyway.
+		if (cost > this->budget)
+			return;
+		this->order.push_front(key);
+		this->entries[key] = { std::move(value), cost, this->order.begin() };
+		this->used += cost;
+		this->evict(garbage);
+	}
+	//Updates the cost of an entry whose value has grown or shrunk since it
+	//was put, as long as the entry still holds that value. Doesn't count as
+	//a use.
+	void recharge(const K &key, const V &value, size_t cost){
+		std::vector<V> garbage;
+		std::lock_guard<std::mutex> lg(this->mutex);
+		auto it = this->entries.find(key);
+		if (it == this->entries.end() || it->second.value != value)
+			return;
+		if (cost > this->budget){
+			this->remove(it, garbage);
+			return;
+		}
+		this->used += cost;
+		this->used -= it->second.cost;
+		it->second.cost = cost;
+		this->evict(garbage);
+	}
+	//Total cost of the entries currently held.
+	size_t get_used() const{
+		std::lock_guard<std::mutex> lg(this->mutex);
+		return this->used;
+	}
+	void erase(const K &key){
+		std::vector<V> garbage;
+		std::lock_guard<std::mutex> lg(this->mutex);
+		auto it = this->entries.find(key);
+		if (it != this->entries.end())
+			this->remove(it, garbage);
+	}
+	void clear(){
+		std::map<K, Entry> garbage;
+		std::lock_guard<std::mutex> lg(this->mutex);
+		garbage.swap(this->entries);
+		this->order.clear();
+		this->used = 0;
+	}
+};
+
+class LoadedGraphics;
+class SvgDocument;
+
+typedef ByteBudgetCache<FileIdentity, std::shared_ptr<LoadedGraphics>> DecodedImageCache;
+typedef ByteBudgetCache<FileIdentity, std::shared_ptr<SvgDocument>> SvgDocumentCache;
+
+#endif
@@ -0,0 +1,107 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "ImageLoader.h"
+#include <QImageReader>
+#include <QBuffer>
+#include <QObject>
+#include <QtConcurrent/QtConcurrentRun>
+#include <algorithm>
+
+//Previews are only worth it for images at least this many pixels big...
+static const qint64 preview_threshold = 2048 * 2048;
+//...and they're decoded to fit in a square this big.
+static const int preview_size = 1024;
+
+ImageLoader::~ImageLoader(){
+	this->cancel();
+	//Workers post to the receiver, so they can't outlive it.
+	for (auto &future : this->workers)
+		future.waitForFinished();
+}
+
+void ImageLoader::cancel(){
+	if (this->cancelled)
+		*this->cancelled = true;
+	this->cancelled.reset();
+	this->generation++;
+	this->loading = false;
+}
+
+void ImageLoader::post(std::uint64_t generation, const callback_t &callback, const graphics_t &graphics, bool last){
+	QMetaObject::invokeMethod(this->receiver, [this, generation, callback, graphics, last](){
+		if (generation != this->generation)
+			return;
+		if (last)
+			this->loading = false;
+		callback(graphics);
+	}, Qt::QueuedConnection);
+}
+
+ImageLoader::graphics_t ImageLoader::decode_preview(const QString &path){
+	QImageReader reader(path);
+	//Only JPEG can decode at a reduced size for a fraction of the cost of a
+	//full decode. Other formats would just take twice as long.
+	if (reader.format() != "jpeg")
+		return {};
+	auto size = reader.size();
+	if ((qint64)size.width() * size.height() < preview_threshold)
+		return {};
+	reader.setScaledSize(size.scaled(preview_size, preview_size, Qt::KeepAspectRatio));
+	auto image = reader.read();
+	if (image.isNull())
+		return {};
+	return std::make_shared<LoadedImage>(image, size);
+}
+
+void ImageLoader::load(const QString &path, ImagePrefetcher::Entry prefetched, const DecodeHint &hint, callback_t on_preview, callback_t on_done, const QByteArray &contents){
+	this->cancel();
+	auto generation = this->generation;
+	//The prefetch's flag is taken over, so that abandoning this load doesn't
+	//leave a worker waiting for a decode nobody wants.
+	if (!prefetched.cancelled)
+		prefetched.cancelled = std::make_shared<std::atomic<bool>>(false);
+	auto cancelled = this->cancelled = prefetched.cancelled;
+	this->loading = true;
+	auto app = this->app;
+	this->workers.erase(
+		std::remove_if(this->workers.begin(), this->workers.end(), [](const QFuture<void> &f){ return f.isFinished(); }),
+		this->workers.end()
+	);
+	this->workers.push_back(QtConcurrent::run([this, app, path, prefetched = prefetched.future, hint, on_preview, on_done, contents, generation, cancelled]() mutable{
+		graphics_t ret;
+		prefetched.waitForFinished();
+		if (is_cancelled(cancelled))
+			return;
+		if (!prefetched.isCanceled())
+			ret = prefetched.result();
+		if (!ret)
+			ret = app->get_image_cache().get(app->get_file_identity(path));
+		if (!ret && contents.isNull()){
+			auto preview = decode_preview(path);
+			if (is_cancelled(cancelled))
+				return;
+			if (preview)
+				this->post(generation, on_preview, preview, false);
+		}
+		if (!ret){
+			std::unique_ptr<QIODevice> dev;
+			if (!contents.isNull()){
+				auto buffer = std::make_unique<QBuffer>();
+				buffer->setData(contents);
+				buffer->open(QIODevice::ReadOnly);
+				dev = std::move(buffer);
+			}
+			ret = LoadedGraphics::create(*app, path, cancelled, hint, std::move(dev));
+		}
+		if (is_cancelled(cancelled))
+			return;
+		if (ret && ret->is_null())
+			ret.reset();
+		this->post(generation, on_done, ret, true);
+	}));
+}
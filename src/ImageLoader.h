@@ -0,0 +1,62 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include "LoadedImage.h"
+#include "ImagePrefetcher.h"
+#include "Streams.h"
+#include <QString>
+#include <QFuture>
+#include <QByteArray>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+class QObject;
+
+//Opens and decodes images off the GUI thread, one at a time. Starting a new
+//load or calling cancel() abandons the previous one; its callbacks are never
+//invoked.
+class ImageLoader{
+public:
+	typedef std::shared_ptr<LoadedGraphics> graphics_t;
+	typedef std::function<void(const graphics_t &)> callback_t;
+private:
+	ImageViewerApplication *app;
+	QObject *receiver;
+	std::uint64_t generation = 0;
+	cancellation_flag_t cancelled;
+	//Cancelled workers may still be running.
+	std::vector<QFuture<void>> workers;
+	bool loading = false;
+
+	void post(std::uint64_t generation, const callback_t &callback, const graphics_t &graphics, bool last);
+	static graphics_t decode_preview(const QString &path);
+public:
+	//Callbacks are run in receiver's thread, which must be the GUI thread.
+	ImageLoader(ImageViewerApplication &app, QObject &receiver): app(&app), receiver(&receiver){}
+	ImageLoader(const ImageLoader &) = delete;
+	ImageLoader &operator=(const ImageLoader &) = delete;
+	~ImageLoader();
+	//on_preview may be called with a reduced-resolution version of the image
+	//before on_done is called with the final result, which is null if the
+	//image couldn't be loaded. If prefetched is a pending decode of the same
+	//path, it's used instead of starting a new one, and cancel() stops it.
+	//Protocol modules aren't guaranteed to be reentrant, so for URLs the
+	//caller reads the file in the GUI thread and passes it in contents. It's
+	//null otherwise.
+	void load(const QString &path, ImagePrefetcher::Entry prefetched, const DecodeHint &hint, callback_t on_preview, callback_t on_done, const QByteArray &contents = {});
+	void cancel();
+	bool is_loading() const{
+		return this->loading;
+	}
+};
+
+#endif
@@ -0,0 +1,97 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "ImagePrefetcher.h"
+#include "DirectoryListing.h"
+#include "Misc.h"
+#include <QtConcurrent/QtConcurrentRun>
+#include <set>
+
+ImagePrefetcher::graphics_t ImagePrefetcher::load(ImageViewerApplication *app, QString path, cancellation_flag_t cancelled, DecodeHint hint){
+	auto ret = LoadedGraphics::create(*app, path, cancelled, hint);
+	if (ret && ret->is_null())
+		ret.reset();
+	return ret;
+}
+
+ImagePrefetcher::graphics_t ImagePrefetcher::take(const QString &path){
+	auto future = this->take_future(path).future;
+	if (future.isCanceled())
+		return {};
+	return future.result();
+}
+
+ImagePrefetcher::Entry ImagePrefetcher::take_future(const QString &path){
+	auto it = this->entries.find(path);
+	if (it == this->entries.end())
+		return {};
+	auto ret = std::move(it->second);
+	this->entries.erase(it);
+	return ret;
+}
+
+bool ImagePrefetcher::is_ready(const QString &path) const{
+	auto it = this->entries.find(path);
+	return it != this->entries.end() && it->second.future.isFinished();
+}
+
+void ImagePrefetcher::abort(Entry &entry){
+	//Decodes that haven't started yet are skipped. Running ones stop at their
+	//next read.
+	*entry.cancelled = true;
+	entry.future.cancel();
+}
+
+void ImagePrefetcher::prefetch(const DirectoryIterator &current, bool forward, size_t ahead, size_t behind, const DecodeHint &hint){
+	auto size = current.get_listing()->size();
+	if (size < 2){
+		this->clear();
+		return;
+	}
+	//Don't wrap around onto the current image or count an entry twice.
+	set_min(ahead, size - 1);
+	set_min(behind, size - 1 - ahead);
+
+	std::set<QString> wanted;
+	auto current_path = *current;
+	auto collect = [&](size_t n, bool direction){
+		auto it = current;
+		while (n--){
+			if (direction)
+				++it;
+			else
+				--it;
+			auto path = *it;
+			if (path != current_path)
+				wanted.insert(path);
+		}
+	};
+	collect(ahead, forward);
+	collect(behind, !forward);
+
+	for (auto it = this->entries.begin(); it != this->entries.end();){
+		if (wanted.find(it->first) == wanted.end()){
+			abort(it->second);
+			it = this->entries.erase(it);
+		}else
+			++it;
+	}
+
+	for (auto &path : wanted){
+		if (this->entries.find(path) != this->entries.end())
+			continue;
+		auto &entry = this->entries[path];
+		entry.cancelled = std::make_shared<std::atomic<bool>>(false);
+		entry.future = QtConcurrent::run(load, this->app, path, entry.cancelled, hint);
+	}
+}
+
+void ImagePrefetcher::clear(){
+	for (auto &kv : this->entries)
+		abort(kv.second);
+	this->entries.clear();
+}
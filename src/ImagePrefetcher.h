@@ -0,0 +1,55 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef IMAGEPREFETCHER_H
+#define IMAGEPREFETCHER_H
+
+#include "LoadedImage.h"
+#include <QString>
+#include <QFuture>
+#include <map>
+#include <memory>
+
+class DirectoryIterator;
+
+//Decodes the neighbors of the current image in the background, so that moving
+//to them only needs to swap the displayed graphics.
+class ImagePrefetcher{
+public:
+	typedef std::shared_ptr<LoadedGraphics> graphics_t;
+	struct Entry{
+		QFuture<graphics_t> future;
+		//Raising it stops the decode at its next read.
+		cancellation_flag_t cancelled;
+	};
+private:
+	ImageViewerApplication *app;
+	std::map<QString, Entry> entries;
+
+	static graphics_t load(ImageViewerApplication *app, QString path, cancellation_flag_t cancelled, DecodeHint hint);
+	static void abort(Entry &);
+public:
+	ImagePrefetcher(ImageViewerApplication &app): app(&app){}
+	ImagePrefetcher(const ImagePrefetcher &) = delete;
+	ImagePrefetcher &operator=(const ImagePrefetcher &) = delete;
+	//Returns the prefetched graphics for path, or null if it wasn't prefetched.
+	//If the decode is still running, this waits for it to finish, which is
+	//never slower than starting a new one.
+	graphics_t take(const QString &path);
+	//Like take(), but hands over the pending decode, along with the flag that
+	//cancels it, without waiting for it. If path wasn't prefetched, the
+	//returned future is empty and canceled, and the flag is null.
+	Entry take_future(const QString &path);
+	//Returns true if path has been prefetched and its decode has finished.
+	bool is_ready(const QString &path) const;
+	//Keeps the next `ahead` entries in the direction of movement and the
+	//previous `behind` entries decoded. Anything else is dropped.
+	void prefetch(const DirectoryIterator &current, bool forward, size_t ahead, size_t behind, const DecodeHint &hint);
+	void clear();
+};
+
+#endif
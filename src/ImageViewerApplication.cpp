@@ -12,16 +12,26 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "OptionsDialog.h"
 #include "GenericException.h"
 #include "ProtocolModule.h"
+#include "AverageColor.h"
 #include <QShortcut>
 #include <QMessageBox>
 #include <sstream>
 #include <cassert>
 #include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QDateTime>
 #include <QStandardPaths>
 #include <QCryptographicHash>
 #include <random>
 #include <QJsonDocument>
 #include <memory>
+#include <QtConcurrent/QtConcurrentRun>
+
+#ifdef ENABLE_SVG
+//Parsed SVG documents get this fraction of the decoded image cache's budget.
+static const size_t svg_document_cache_divisor = 8;
+#endif
 
 template <typename T>
 class AutoSetter{
@@ -60,12 +70,22 @@ ImageViewerApplication::ImageViewerApplication(int &argc, char **argv, const QSt
 		tray_icon(QIcon(":/icon16.png"), this){
 	QDir::setCurrent(this->applicationDirPath());
 	this->load_custom_file_protocols();
+#ifdef ENABLE_SVG
+	this->svg_options = QtConcurrent::run([](){
+		auto ret = std::make_shared<ReSvgOptions>();
+		ret->load_system_fonts();
+		return std::shared_ptr<const ReSvgOptions>(ret);
+	});
+#endif
 	this->restore_settings_only();
+	this->set_cache_budgets();
+	set_average_color_tolerance(this->settings->get_background_color_tolerance());
+	set_include_extensionless_files(this->settings->get_include_extensionless_files());
 	this->reset_tray_menu();
 	this->conditional_tray_show();
 	this->setQuitOnLastWindowClosed(!this->settings->get_keep_application_in_background());
 	ImageViewerApplication::new_instance(this->args);
-	if (!this->windows.size() && !this->settings->get_keep_application_in_background())
+	if (!this->windows.size() && !this->opening_windows.size() && !this->settings->get_keep_application_in_background())
 		throw NoWindowsException();
 	
 	this->setup_slots();
@@ -82,12 +102,23 @@ void ImageViewerApplication::new_instance(const QStringList &args){
 	}
 	
 	auto p = std::make_shared<MainWindow>(*this, args);
-	if (!p->is_null())
+	if (p->is_opening() || !p->is_null())
 		this->add_window(p);
 	this->save_settings();
 }
 
 void ImageViewerApplication::add_window(sharedp_t p){
+	if (p->is_opening()){
+		//Queued, so that a window that failed to open isn't destroyed from
+		//within its own signal.
+		connect(p.get(), &MainWindow::opened, this, &ImageViewerApplication::window_opened, Qt::QueuedConnection);
+		this->opening_windows[(uintptr_t)p.get()] = p;
+		return;
+	}
+	this->show_window(p);
+}
+
+void ImageViewerApplication::show_window(sharedp_t p){
 	if (!p->is_loaded()){
 		p->close();
 		return;
@@ -100,6 +131,20 @@ void ImageViewerApplication::add_window(sharedp_t p){
 	this->windows[(uintptr_t)p.get()] = p;
 }
 
+void ImageViewerApplication::window_opened(MainWindow *window){
+	auto it = this->opening_windows.find((uintptr_t)window);
+	if (it == this->opening_windows.end())
+		return;
+	auto p = std::move(it->second);
+	this->opening_windows.erase(it);
+	disconnect(p.get(), &MainWindow::opened, this, &ImageViewerApplication::window_opened);
+	//It may still be loading the full image behind a preview.
+	this->show_window(p);
+	//Nothing from startup could be opened.
+	if (!this->windows.size() && !this->opening_windows.size() && !this->settings->get_keep_application_in_background())
+		this->quit();
+}
+
 void ImageViewerApplication::window_closing(MainWindow *window){
 	auto it = this->windows.find((uintptr_t)window);
 	if (it == this->windows.end())
@@ -108,7 +153,7 @@ void ImageViewerApplication::window_closing(MainWindow *window){
 }
 
 template <typename ListingT, typename ListT>
-std::shared_ptr<DirectoryIterator> generic_get_dir(ListT &list, const QString &path, bool local, CustomProtocolHandler &handler){
+std::shared_ptr<DirectoryIterator> generic_get_dir(ListT &list, const QString &path, bool local, CustomProtocolHandler &handler, SortMode mode){
 	for (auto &p : list){
 		if (p.first->is_local() == local && *p.first == path){
 			p.second++;
@@ -118,6 +163,7 @@ std::shared_ptr<DirectoryIterator> generic_get_dir(ListT &list, const QString &p
 	auto listing = std::make_shared<ListingT>(path, handler);
 	if (!*listing)
 		return std::shared_ptr<DirectoryIterator>();
+	listing->set_sort_mode(mode);
 	list.push_back(std::make_pair(listing, 1));
 	return std::make_shared<DirectoryIterator>(*listing);
 }
@@ -127,13 +173,13 @@ std::shared_ptr<DirectoryIterator> ImageViewerApplication::request_local_directo
 	std::shared_ptr<DirectoryIterator> ret;
 	if (!check_and_clean_path(clean))
 		return ret;
-	return generic_get_dir<LocalDirectoryListing>(this->listings, clean, true, *this->protocol_handler);
+	return generic_get_dir<LocalDirectoryListing>(this->listings, clean, true, *this->protocol_handler, this->settings->get_sort_mode());
 }
 
 std::shared_ptr<DirectoryIterator> ImageViewerApplication::request_directory_iterator_by_url(const QString &url){
 	if (!this->protocol_handler->is_url(url))
 		return std::shared_ptr<DirectoryIterator>();
-	return generic_get_dir<ProtocolDirectoryListing>(this->listings, url, false, *this->protocol_handler);
+	return generic_get_dir<ProtocolDirectoryListing>(this->listings, url, false, *this->protocol_handler, this->settings->get_sort_mode());
 }
 
 void ImageViewerApplication::release_directory(std::shared_ptr<DirectoryIterator> it){
@@ -270,9 +316,37 @@ std::shared_ptr<QMenu> ImageViewerApplication::build_context_menu(MainWindow *ca
 	return ret;
 }
 
+#ifdef ENABLE_SVG
+std::shared_ptr<const ReSvgOptions> ImageViewerApplication::get_svg_preview_options(){
+	std::call_once(this->svg_preview_options_created, [this](){
+		auto ret = std::make_shared<ReSvgOptions>();
+		ret->set_shape_rendering_mode(ReSvgOptions::ShapeRenderingMode::OptimizeSpeed);
+		ret->set_text_rendering_mode(ReSvgOptions::TextRenderingMode::OptimizeSpeed);
+		ret->set_image_rendering_mode(ReSvgOptions::ImageRenderingMode::OptimizeSpeed);
+		//Copying the fonts is much cheaper than scanning for them again.
+		ret->copy_fonts(*this->get_svg_options());
+		this->svg_preview_options = ret;
+	});
+	return this->svg_preview_options;
+}
+#endif
+
+void ImageViewerApplication::set_cache_budgets(){
+	auto budget = (size_t)this->settings->get_decoded_image_cache_size() << 20;
+	this->image_cache.set_budget(budget);
+#ifdef ENABLE_SVG
+	this->svg_cache.set_budget(budget / svg_document_cache_divisor);
+#endif
+}
+
 void ImageViewerApplication::set_option_values(MainSettings &settings){
 	*this->settings = settings;
 	this->setQuitOnLastWindowClosed(!this->settings->get_keep_application_in_background());
+	this->set_cache_budgets();
+	set_average_color_tolerance(this->settings->get_background_color_tolerance());
+	set_include_extensionless_files(this->settings->get_include_extensionless_files());
+	for (auto &p : this->listings)
+		p.first->set_sort_mode(this->settings->get_sort_mode());
 }
 
 void ImageViewerApplication::show_options(){
@@ -423,22 +497,47 @@ void ImageViewerApplication::load_custom_file_protocols(){
 	this->protocol_handler.reset(new CustomProtocolHandler(this->get_config_location()));
 }
 
-QImage ImageViewerApplication::load_image(std::unique_ptr<QIODevice> &&dev, const QString &path){
-	if (!dev)
-		return QImage(path);
-	QImage ret;
-	auto filename = this->protocol_handler->get_filename(path);
-	auto extension = QFileInfo(filename).suffix().toStdString();
+QImage ImageViewerApplication::load_image(std::unique_ptr<QIODevice> &&dev, const QString &path, const DecodeHint &hint, QSize *full_size, QByteArray format){
+	if (!dev){
+		auto file = std::make_unique<QFile>(path);
+		if (!file->open(QIODevice::ReadOnly))
+			return {};
+		dev = std::move(file);
+	}
+	if (format.isEmpty())
+		format = this->get_file_type(*dev, path).format;
 	auto t0 = clock();
-	ret.load(dev.get(), extension.c_str());
-	if (ret.isNull()){
+	QSize size, target;
+	auto read = [&](const QByteArray &format){
+		QImageReader reader(dev.get(), format);
+		size = reader.size();
+		target = hint.target_size(size);
+		//Formats like JPEG can skip most of the work of decoding when asked
+		//for a smaller size.
+		if (target != size && reader.supportsOption(QImageIOHandler::ScaledSize))
+			reader.setScaledSize(target);
+		return reader.read();
+	};
+	auto ret = read(format);
+	//The format is only a guess from the first few bytes or the extension,
+	//and some plugins claim anything that's labeled as theirs. Without one,
+	//the reader works it out from the contents.
+	if (ret.isNull() && !format.isEmpty() && dev->seek(0))
+		ret = read({});
+	if (ret.isNull() && CustomProtocolHandler::is_url(path)){
 		//Workaround. QImage refuses to read certain files correctly.
 		auto n = dev->size();
 		std::unique_ptr<uchar[]> temp(new uchar[n]);
 		dev->seek(0);
-		dev->read((char *)temp.get(), n);
-		ret.loadFromData(temp.get(), n, extension.c_str());
+		if (dev->read((char *)temp.get(), n) == n)
+			ret.loadFromData(temp.get(), n, format.constData());
 	}
+	if (!size.isValid())
+		size = ret.size();
+	if (!ret.isNull() && target.isValid() && ret.size() != target)
+		ret = ret.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+	if (full_size)
+		*full_size = size;
 	auto t1 = clock();
 	qDebug() << "Load " << path << " took " << (t1 - t0) / (double)CLOCKS_PER_SEC;
 	return ret;
@@ -463,31 +562,37 @@ std::unique_ptr<QIODevice> ImageViewerApplication::open_file(const QString &path
 	return this->protocol_handler->open(path);
 }
 
-std::pair<std::unique_ptr<QIODevice>, std::unique_ptr<QMovie>> ImageViewerApplication::load_animation(std::unique_ptr<QIODevice> &&dev, const QString &path){
-	std::unique_ptr<QMovie> mov;
-	if (!dev)
-		mov = std::make_unique<QMovie>(path);
-	else
-		mov = std::make_unique<QMovie>(dev.get());
-	if (mov->frameCount() == 1)
-		mov.reset();
-	return {std::move(dev), std::move(mov)};
-}
-
-bool ImageViewerApplication::is_animation(const QString &path){
-	auto testString = this->protocol_handler->get_filename(path);
-	if (testString.isNull())
-		testString = path;
-	return testString.endsWith(".gif", Qt::CaseInsensitive) ||
-		testString.endsWith(".webp", Qt::CaseInsensitive);
-}
-
-bool ImageViewerApplication::is_svg(const QString &path){
-	auto testString = this->protocol_handler->get_filename(path);
-	if (testString.isNull())
-		testString = path;
-	return testString.endsWith(".svg", Qt::CaseInsensitive) ||
-		testString.endsWith(".svgz", Qt::CaseInsensitive);
+FileIdentity ImageViewerApplication::get_file_identity(const QString &path){
+	FileIdentity ret;
+	ret.path = path;
+	if (CustomProtocolHandler::is_url(path))
+		return ret;
+	QFileInfo info(path);
+	if (!info.exists())
+		return ret;
+	ret.timestamp = info.lastModified().toMSecsSinceEpoch();
+	ret.size = info.size();
+	return ret;
+}
+
+FileType ImageViewerApplication::get_file_type(const QString &path){
+	//Protocol modules aren't guaranteed to be reentrant, so URLs aren't opened
+	//just to look at them.
+	if (!CustomProtocolHandler::is_url(path)){
+		QFile file(path);
+		if (file.open(QIODevice::ReadOnly))
+			return this->get_file_type(file, path);
+	}
+	auto filename = this->protocol_handler->get_filename(path);
+	return guess_file_type(filename.isNull() ? path : filename);
+}
+
+FileType ImageViewerApplication::get_file_type(QIODevice &dev, const QString &path){
+	auto ret = sniff_file_type(dev);
+	if (ret.kind != FileKind::Unknown)
+		return ret;
+	auto filename = this->protocol_handler->get_filename(path);
+	return guess_file_type(filename.isNull() ? path : filename);
 }
 
 QString ImageViewerApplication::get_filename_from_url(const QString &url){
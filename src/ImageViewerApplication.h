@@ -13,12 +13,18 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "Shortcuts.h"
 #include "Streams.h"
 #include "Enums.h"
+#include "ImageCache.h"
+#include "DecodeHint.h"
+#include "FileType.h"
+#include "resvg.hpp"
 #include <QMenu>
+#include <QFuture>
 #include <memory>
 #include <exception>
 #include <QSystemTrayIcon>
 #include <QWindow>
 #include <optional>
+#include <mutex>
 
 class QAction;
 class CustomProtocolHandler;
@@ -44,6 +50,9 @@ class ImageViewerApplication : public SingleInstanceApplication{
 
 	typedef std::shared_ptr<MainWindow> sharedp_t;
 	std::map<uintptr_t, sharedp_t> windows;
+	//Windows whose first file is still being opened. They're only shown once
+	//there's something in them.
+	std::map<uintptr_t, sharedp_t> opening_windows;
 	std::vector<std::pair<std::shared_ptr<DirectoryListing>, unsigned>> listings;
 	bool do_not_save;
 	std::vector<std::shared_ptr<QAction> > actions;
@@ -65,6 +74,19 @@ class ImageViewerApplication : public SingleInstanceApplication{
 	QByteArray last_saved_settings_digest;
 	QByteArray last_saved_state_digest;
 	std::map<QString, std::unique_ptr<ResolutionChangeCallback>> rccbs;
+	DecodedImageCache image_cache;
+#ifdef ENABLE_SVG
+	//Scanning the system fonts takes a while, so it's done once in the
+	//background and the result is shared by every SVG parse.
+	QFuture<std::shared_ptr<const ReSvgOptions>> svg_options;
+	//Trades antialiasing and image smoothing for speed, for previews. Only
+	//made once the first preview is needed, since most SVGs don't get one.
+	std::once_flag svg_preview_options_created;
+	std::shared_ptr<const ReSvgOptions> svg_preview_options;
+	//Parsed documents outlive the renders in image_cache, so that going back
+	//to an SVG doesn't parse it again.
+	SvgDocumentCache svg_cache;
+#endif
 
 	void save_current_state(ApplicationState &);
 	void save_current_windows(std::vector<std::shared_ptr<WindowState>> &);
@@ -78,12 +100,14 @@ class ImageViewerApplication : public SingleInstanceApplication{
 	void setup_slots();
 	void reset_tray_menu();
 	void conditional_tray_show();
+	void set_cache_budgets();
 	std::unique_ptr<CustomProtocolHandler> protocol_handler;
 	bool get_state_is_empty();
 
 protected:
 	void new_instance(const QStringList &args) override;
 	void add_window(sharedp_t window);
+	void show_window(sharedp_t window);
 	static QJsonDocument load_json(const QString &, QByteArray &digest);
 	void restore_settings_only();
 	void restore_state_only();
@@ -132,10 +156,14 @@ public:
 	}
 	void set_option_values(MainSettings &settings);
 	void load_custom_file_protocols();
-	QImage load_image(std::unique_ptr<QIODevice> &&dev, const QString &);
-	std::pair<std::unique_ptr<QIODevice>, std::unique_ptr<QMovie>> load_animation(std::unique_ptr<QIODevice> &&dev, const QString &path);
-	bool is_animation(const QString &);
-	bool is_svg(const QString &);
+	//Decodes the image, scaled down to the size hint calls for. If full_size is
+	//given, it receives the size of the image at full resolution. Without a
+	//device, the file is opened, and without a format, it's sniffed.
+	QImage load_image(std::unique_ptr<QIODevice> &&dev, const QString &, const DecodeHint &hint = {}, QSize *full_size = nullptr, QByteArray format = {});
+	//Goes by the contents, or by the extension if they don't say. URLs only
+	//go by the extension.
+	FileType get_file_type(const QString &);
+	FileType get_file_type(QIODevice &, const QString &);
 	QString get_filename_from_url(const QString &);
 	QString get_unique_filename_from_url(const QString &);
 	void turn_transparent(MainWindow &window, bool yes);
@@ -143,9 +171,27 @@ public:
 	void resolution_change(QScreen &);
 	void work_area_change(QScreen &);
 	std::unique_ptr<QIODevice> open_file(const QString &);
+	FileIdentity get_file_identity(const QString &);
+	DecodedImageCache &get_image_cache(){
+		return this->image_cache;
+	}
+#ifdef ENABLE_SVG
+	//Waits for the system fonts to finish loading. Can be called from any
+	//thread.
+	std::shared_ptr<const ReSvgOptions> get_svg_options() const{
+		return this->svg_options.result();
+	}
+	//Shares the fonts loaded for get_svg_options(), so it waits for them too.
+	//Can be called from any thread.
+	std::shared_ptr<const ReSvgOptions> get_svg_preview_options();
+	SvgDocumentCache &get_svg_cache(){
+		return this->svg_cache;
+	}
+#endif
 
 public slots:
 	void window_closing(MainWindow *);
+	void window_opened(MainWindow *);
 	void show_options();
 	void screen_added(QScreen *);
 	void screen_removed(QScreen *);
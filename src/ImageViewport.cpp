@@ -43,6 +43,9 @@ QTransform translate(const QTransform &m, const QPointF &offset){
 	return QTransform(m.m11(), m.m12(), m.m21(), m.m22(), m.dx() + offset.x(), m.dy() + offset.y());
 }
 
+//Above this many device pixels, the transformed image isn't cached.
+static const qint64 max_cached_render = 16 << 20;
+
 void ImageViewport::paintEvent(QPaintEvent *){
 	QPainter painter(this);
 	if (!this->pixmap() && !this->movie()){
@@ -56,6 +59,31 @@ void ImageViewport::paintEvent(QPaintEvent *){
 		return;
 	}
 
+	auto dpr = this->devicePixelRatioF();
+	auto size = this->get_size();
+	bool cacheable =
+		!this->movie() &&
+		!(this->graphics && this->graphics->paints_on_demand()) &&
+		(qint64)(size.width() * dpr) * (qint64)(size.height() * dpr) <= max_cached_render;
+	if (!cacheable){
+		//Graphics that render what's visible on demand need to know all of
+		//it, not just the part being repainted. The painter is clipped to the
+		//latter anyway.
+		this->render(painter, this->visibleRegion().boundingRect());
+		return;
+	}
+	if (this->cached_render.isNull() || this->cached_render.devicePixelRatio() != dpr){
+		QPixmap pixmap(size * dpr);
+		pixmap.setDevicePixelRatio(dpr);
+		pixmap.fill(Qt::transparent);
+		QPainter render_painter(&pixmap);
+		this->render(render_painter, QRect(QPoint(0, 0), size));
+		this->cached_render = pixmap;
+	}
+	painter.drawPixmap(0, 0, this->cached_render);
+}
+
+void ImageViewport::render(QPainter &painter, const QRect &exposed){
 	painter.setRenderHint(or_flags(QPainter::SmoothPixmapTransform, QPainter::Antialiasing));
 	painter.setClipping(false);
 
@@ -64,6 +92,12 @@ void ImageViewport::paintEvent(QPaintEvent *){
 	auto offset = src_quad.move_to_origin();
 	transform = translate(transform, offset);
 	painter.setTransform(transform);
+	if (this->graphics){
+		auto visible = transform.inverted().mapRect(QRectF(exposed));
+		visible &= QRectF(QPointF(0, 0), this->image_size);
+		if (this->graphics->paint(painter, visible, this->zoom * this->devicePixelRatioF()))
+			return;
+	}
 	if (!!this->pixmap())
 		painter.drawPixmap(QRect(QPoint(0, 0), this->image_size), this->pixmap());
 	else
@@ -80,6 +114,7 @@ void ImageViewport::load_state(const WindowState &state){
 }
 
 void ImageViewport::transform_changed(){
+	this->invalidate_render();
 	this->resize(this->get_size());
 	emit this->transform_updated();
 }
@@ -89,7 +124,9 @@ void ImageViewport::set_transform(const QTransform &m){
 	this->transform_changed();
 }
 
-void ImageViewport::set_image(LoadedGraphics &li){
-	this->image_size = li.get_size();
-	li.assign_to_QLabel(*this);
+void ImageViewport::set_image(const std::shared_ptr<LoadedGraphics> &li){
+	this->graphics = li;
+	this->invalidate_render();
+	this->image_size = li->get_size();
+	li->assign_to_QLabel(*this);
 }
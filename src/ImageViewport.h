@@ -13,8 +13,11 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include <QLabel>
 #include <QImage>
 #include <QTransform>
+#include <QPixmap>
+#include <memory>
 
 class LoadedGraphics;
+class QPainter;
 
 class ImageViewport : public QLabel
 {
@@ -22,6 +25,10 @@ class ImageViewport : public QLabel
 	QTransform transform;
 	double zoom;
 	QSize image_size;
+	std::shared_ptr<LoadedGraphics> graphics;
+	//The image as it was last painted, with the transform and zoom already
+	//applied, so that repaints that don't change either are a plain blit.
+	QPixmap cached_render;
 
 	QTransform get_final_transform() const{
 		auto ret = this->transform;
@@ -46,12 +53,19 @@ class ImageViewport : public QLabel
 		return this->compute_quad(this->image_size);
 	}
 	void transform_changed();
+	void render(QPainter &, const QRect &exposed);
+	void invalidate_render(){
+		this->cached_render = QPixmap();
+	}
 public:
 	explicit ImageViewport(QWidget *parent = 0);
 	void reset_transform(){
 		this->transform.reset();
+		this->invalidate_render();
 	}
 	void set_zoom(double x){
+		if (this->zoom != x)
+			this->invalidate_render();
 		this->zoom = x;
 	}
 	void rotate(double delta_theta);
@@ -88,7 +102,7 @@ public:
 	void load_state(const WindowState &);
 
 	void paintEvent(QPaintEvent *) override;
-	void set_image(LoadedGraphics &li);
+	void set_image(const std::shared_ptr<LoadedGraphics> &li);
 
 signals:
 	void transform_updated();
@@ -6,63 +6,65 @@ Distributed under a permissive license. See COPYING.txt for details.
 */
 
 #include "LoadedImage.h"
+#include "TiledImage.h"
+#include "AverageColor.h"
 #include "DirectoryListing.h"
 #include <QImage>
 #include <QtConcurrent/QtConcurrentRun>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QThreadPool>
 #include <QLabel>
 #include <tuple>
 #include <QFile>
+#include <QImageReader>
+#include <QCoreApplication>
+#include <QPainter>
+#include <QTimer>
+#include <QRegion>
+#include <algorithm>
+#include <cmath>
+#include "ProtocolModule.h"
 
 extern const char *supported_extensions[];
 
-LoadedImage::LoadedImage(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path){
-	auto img = app.load_image(std::move(dev), path);
-	if ((this->null = img.isNull())){
-		//Weird QImage behavior. Passing "*" allows it to load images where the
-		//file extension doesn't match the file contents.
-		img = QImage(path, "*");
-		if ((this->null = img.isNull()))
-			return;
-	}
+LoadedImage::LoadedImage(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path, const cancellation_flag_t &, const DecodeHint &hint, const QByteArray &format){
+	//Only local files are decoded again later, since protocol modules aren't
+	//guaranteed to be reentrant.
+	bool local = !CustomProtocolHandler::is_url(path);
+	QSize full_size;
+	auto img = app.load_image(std::move(dev), path, local ? hint : DecodeHint(), &full_size, format);
+	if ((this->null = img.isNull()))
+		return;
 	this->compute_average_color(img);
 	this->image = QtConcurrent::run([](QImage img){ return QPixmap::fromImage(img); }, img);
-	this->size = img.size();
+	this->decoded_size = img.size();
+	this->size = full_size.isValid() ? full_size : img.size();
 	this->alpha = img.hasAlphaChannel();
+	if (local && this->decoded_size != this->size){
+		this->app = &app;
+		this->path = path;
+	}
 }
 
 LoadedImage::LoadedImage(const QImage &image){
 	this->compute_average_color(image);
 	this->image = QtConcurrent::run([](QImage img){ return QPixmap::fromImage(img); }, image);
-	this->size = image.size();
+	this->size = this->decoded_size = image.size();
 	this->alpha = image.hasAlphaChannel();
 }
 
-LoadedImage::~LoadedImage(){
-	this->background_color.cancel();
+LoadedImage::LoadedImage(const QImage &image, const QSize &logical_size): LoadedImage(image){
+	this->size = logical_size;
 }
 
-QColor get_average_color(QImage src){
-	if (src.depth() < 32)
-		src = src.convertToFormat(QImage::Format_ARGB32);
-	quint64 avg[3] = {0};
-	unsigned pixel_count=0;
-	for (auto y = src.height() * 0; y < src.height(); y++){
-		const uchar *p = src.constScanLine(y);
-		for (auto x = src.width() * 0; x < src.width(); x++){
-			avg[0] += quint64(p[2]) * quint64(p[3]) / 255;
-			avg[1] += quint64(p[1]) * quint64(p[3]) / 255;
-			avg[2] += quint64(p[0]) * quint64(p[3]) / 255;
-			p += 4;
-			pixel_count++;
-		}
-	}
-	for (int a = 0; a < 3; a++)
-		avg[a] /= pixel_count;
-	return QColor(avg[0], avg[1], avg[2]);
+LoadedImage::~LoadedImage(){
+	this->background_color.cancel();
+	if (this->refinement_cancelled)
+		*this->refinement_cancelled = true;
 }
 
 QColor background_color_parallel_function(QImage img){
-	QColor avg = get_average_color(img),
+	QColor avg = estimate_average_color(img),
 		negative = avg,
 		background;
 	negative.setRedF(1 - negative.redF());
@@ -87,92 +89,690 @@ QImage LoadedImage::get_QImage() const{
 	return this->image.result().toImage();
 }
 
-LoadedAnimation::LoadedAnimation(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path){
-	std::tie(this->device, this->animation) = app.load_animation(std::move(dev), path);
-	this->null = !this->animation || !this->animation->isValid();
-	if (!this->null){
-		(void)this->animation->jumpToNextFrame();
-		this->size = this->animation->currentPixmap().size();
-		this->alpha = true;
+size_t LoadedImage::get_memory_usage() const{
+	auto ret = (size_t)this->decoded_size.width() * (size_t)this->decoded_size.height() * 4;
+	for (auto &mipmap : this->mipmaps)
+		ret += (size_t)mipmap.width() * (size_t)mipmap.height() * 4;
+	return ret;
+}
+
+void LoadedImage::request_refinement(double zoom){
+	if (!this->app || this->refining)
+		return;
+	//Allow for rounding in the computation of the reduced size.
+	if (this->decoded_size.width() + 1 >= this->size.width() * zoom)
+		return;
+	this->refining = true;
+	std::weak_ptr<LoadedGraphics> weak = this->shared_from_this();
+	auto app = this->app;
+	auto path = this->path;
+	auto cancelled = this->refinement_cancelled = std::make_shared<std::atomic<bool>>(false);
+	QtConcurrent::run([app, path, cancelled](){
+		auto file = std::make_unique<QFile>(path);
+		if (!file->open(QIODevice::ReadOnly))
+			return QPixmap();
+		auto dev = std::make_unique<CancellableDevice>(std::move(file), cancelled);
+		return QPixmap::fromImage(app->load_image(std::move(dev), path));
+	}).then(qApp, [weak, cancelled](QPixmap pixmap){
+		auto self = weak.lock();
+		//Whoever cancelled it has already taken care of the rest.
+		if (self && !*cancelled)
+			static_cast<LoadedImage &>(*self).refinement_finished(pixmap);
+	});
+}
+
+void LoadedImage::no_longer_displayed(){
+	//Nobody is zoomed in any more. The next window to display the image asks
+	//again if it needs to.
+	if (!this->refining)
+		return;
+	*this->refinement_cancelled = true;
+	this->refining = false;
+}
+
+void LoadedImage::refinement_finished(const QPixmap &pixmap){
+	this->refining = false;
+	//The file might have changed or vanished. Keep what we have, and don't
+	//try again.
+	if (pixmap.size() != this->size){
+		this->app = nullptr;
+		return;
 	}
+	this->image = QtFuture::makeReadyValueFuture(pixmap);
+	this->decoded_size = pixmap.size();
+	this->app = nullptr;
+	this->mipmaps.clear();
+	this->mipmaps_requested = false;
+	this->update_memory_usage();
+	this->notify_updated();
+}
+
+void LoadedImage::build_mipmaps(){
+	this->mipmaps_requested = true;
+	std::weak_ptr<LoadedGraphics> weak = this->weak_from_this();
+	if (weak.expired())
+		return;
+	auto source = this->image.result();
+	QtConcurrent::run([source](){
+		std::vector<QPixmap> ret;
+		auto image = source.toImage();
+		while (std::max(image.width(), image.height()) > 16){
+			//Smooth downscaling averages the source pixels, so each level is
+			//properly prefiltered.
+			image = image.scaled((image.width() + 1) / 2, (image.height() + 1) / 2, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+			ret.push_back(QPixmap::fromImage(image));
+		}
+		return ret;
+	}).then(qApp, [weak, key = source.cacheKey()](std::vector<QPixmap> mipmaps){
+		auto self = weak.lock();
+		if (!self)
+			return;
+		auto &li = static_cast<LoadedImage &>(*self);
+		//The image was refined in the meantime.
+		if (li.image.result().cacheKey() != key)
+			return;
+		li.mipmaps = std::move(mipmaps);
+		li.update_memory_usage();
+		li.notify_updated();
+	});
+}
+
+bool LoadedImage::paint(QPainter &painter, const QRectF &, double zoom){
+	if (this->decoded_size.isEmpty() || zoom <= 0)
+		return false;
+	//Relative to the pixels we actually have.
+	zoom *= (double)this->size.width() / this->decoded_size.width();
+	if (zoom >= 0.5)
+		return false;
+	if (!this->mipmaps_requested)
+		this->build_mipmaps();
+	//Pick the smallest level that still has at least as many pixels as will
+	//be displayed.
+	auto level = std::min((size_t)floor(log2(1 / zoom)), this->mipmaps.size());
+	if (!level)
+		return false;
+	auto &pixmap = this->mipmaps[level - 1];
+	painter.drawPixmap(QRectF(QPointF(0, 0), this->size), pixmap, pixmap.rect());
+	return true;
+}
+
+LoadedAnimation::LoadedAnimation(std::unique_ptr<QIODevice> &&dev, const QByteArray &format):
+		device(std::move(dev)),
+		format(format){
+	int frames;
+	{
+		QImageReader reader(this->device.get(), format);
+		frames = reader.imageCount();
+		this->first_frame = reader.read();
+	}
+	//A single frame is better off decoded as a still image.
+	this->null = this->first_frame.isNull() || frames == 1 || !this->device->reset();
+	if (this->null)
+		return;
+	this->size = this->first_frame.size();
+	this->alpha = true;
+	//QMovie reads from the GUI thread.
+	this->device->moveToThread(QCoreApplication::instance()->thread());
 }
 
 void LoadedAnimation::assign_to_QLabel(QLabel &label){
+	if (!this->animation)
+		this->animation = std::make_unique<QMovie>(this->device.get(), this->format);
 	label.setMovie(this->animation.get());
 	this->animation->start();
 }
 
 QImage LoadedAnimation::get_QImage() const{
-	return this->animation->currentImage();
+	return this->animation ? this->animation->currentImage() : this->first_frame;
+}
+
+void LoadedGraphics::add_listener(QObject *owner, std::function<void()> &&callback){
+	this->listeners.emplace_back(owner, std::move(callback));
+}
+
+void LoadedGraphics::remove_listener(QObject *owner){
+	auto &l = this->listeners;
+	if (l.empty())
+		return;
+	l.erase(std::remove_if(l.begin(), l.end(), [owner](const auto &p){ return !p.first || p.first == owner; }), l.end());
+	if (l.empty())
+		this->no_longer_displayed();
+}
+
+void LoadedGraphics::notify_updated(){
+	//Callbacks may add or remove listeners.
+	auto copy = this->listeners;
+	for (auto &[owner, callback] : copy)
+		if (owner)
+			callback();
+	this->remove_listener(nullptr);
 }
 
-std::shared_ptr<LoadedGraphics> LoadedGraphics::create(ImageViewerApplication &app, const QString &path){
-	auto dev = app.open_file(path);
-	if (app.is_svg(path))
+std::shared_ptr<LoadedGraphics> LoadedGraphics::create(ImageViewerApplication &app, const QString &path, const cancellation_flag_t &cancelled, const DecodeHint &hint, std::unique_ptr<QIODevice> &&dev){
+	auto &cache = app.get_image_cache();
+	auto key = app.get_file_identity(path);
+	auto ret = cache.get(key);
+	if (ret)
+		return ret;
+	ret = create_uncached(app, path, cancelled, hint, std::move(dev));
+	if (ret && !ret->is_null()){
+		ret->cache = &cache;
+		ret->cache_key = key;
+		if (ret->is_cacheable())
+			cache.put(key, ret, ret->get_memory_usage());
+	}
+	return ret;
+}
+
+void LoadedGraphics::update_memory_usage(){
+	if (this->cache)
+		this->cache->recharge(this->cache_key, this->shared_from_this(), this->get_memory_usage());
+}
+
+void LoadedGraphics::add_to_cache(){
+	if (this->cache && this->is_cacheable())
+		this->cache->put(this->cache_key, this->shared_from_this(), this->get_memory_usage());
+}
+
+std::shared_ptr<LoadedGraphics> LoadedGraphics::create_uncached(ImageViewerApplication &app, const QString &path, const cancellation_flag_t &cancelled, const DecodeHint &hint, std::unique_ptr<QIODevice> &&dev){
+	bool local = !CustomProtocolHandler::is_url(path);
+	if (!dev && !local)
+		dev = app.open_file(path);
+	if (!dev){
+		auto file = std::make_unique<QFile>(path);
+		if (!file->open(QIODeviceBase::ReadOnly))
+			return nullptr;
+		dev = std::move(file);
+	}
+	//The file is opened once. The bytes looked at to pick the decoder are
+	//still buffered when it starts reading.
+	auto type = app.get_file_type(*dev, path);
+	if (type.kind == FileKind::Svg)
 #ifdef ENABLE_SVG
-		return std::make_unique<SvgImage>(app, std::move(dev), path);
+		return std::make_unique<SvgImage>(app, std::move(dev), path, cancelled);
 #else
 		return {};
 #endif
-	auto is_animation = app.is_animation(path);
-	if (is_animation){
-		auto animation = std::make_unique<LoadedAnimation>(app, std::move(dev), path);
-		if (!animation->is_null())
-			return animation;
-		dev = animation->get_device();
-	}
-	if (dev)
+	if (type.kind == FileKind::Animation){
+		auto ret = std::make_unique<LoadedAnimation>(std::move(dev), type.format);
+		if (!ret->is_null())
+			return ret;
+		dev = ret->get_device();
 		dev->reset();
-	return std::make_unique<LoadedImage>(app, std::move(dev), path);
+	}
+	if (local){
+		//Read local files through a device that can cut the decode short.
+		if (cancelled)
+			dev = std::make_unique<CancellableDevice>(std::move(dev), cancelled);
+		//Images too large to keep in memory are decoded a region at a time.
+		//Only local files can be re-read safely from other threads.
+		auto tiled = TiledImage::create(*dev, path, type.format);
+		if (tiled)
+			return tiled;
+		if (is_cancelled(cancelled))
+			return nullptr;
+		dev->reset();
+	}
+	std::shared_ptr<LoadedGraphics> ret = std::make_unique<LoadedImage>(app, std::move(dev), path, cancelled, hint, type.format);
+	if (is_cancelled(cancelled))
+		ret.reset();
+	return ret;
 }
 
 #ifdef ENABLE_SVG
 
-QByteArray read_file(const std::unique_ptr<QIODevice> &dev, const QString &path){
-	if (dev)
-		return dev->readAll();
-	QFile file(path);
-	file.open(QIODeviceBase::ExistingOnly | QIODeviceBase::ReadOnly);
-	return file.readAll();
+//Zoom changes are only followed by a new render once they stop for this long.
+static const int svg_refinement_delay = 200;
+//In pixels.
+static const double max_svg_render = 32 << 20;
+//Renders smaller than this aren't worth parsing more trees for.
+static const qint64 min_parallel_svg_render = 1 << 20;
+static const int min_svg_band_height = 64;
+//Smaller renders are still split into up to this many bands, one after the
+//other, so that they can be stopped partway. Every band costs a walk over
+//the tree, so there aren't many.
+static const int max_serial_svg_bands = 4;
+//Fraction of the visible size rendered beyond each side of it.
+static const double svg_region_margin = 0.5;
+//SVGs at least this many pixels big, or with sources at least this big, are
+//likely to take a while to render, so a quick preview is shown first...
+static const qint64 svg_preview_threshold = 2048 * 2048;
+static const size_t svg_preview_source_threshold = 1 << 20;
+//...rendered to fit in a square this big.
+static const int svg_preview_size = 1024;
+//Renders still going after this many milliseconds are given up on.
+static const int svg_render_deadline = 30000;
+
+static double get_svg_preview_scale(const QSize &size){
+	return std::min(1.0, (double)svg_preview_size / std::max(size.width(), size.height()));
+}
+
+static size_t get_pixmap_memory_usage(const QPixmap &pixmap){
+	return (size_t)pixmap.width() * (size_t)pixmap.height() * 4;
+}
+
+typedef std::chrono::steady_clock::time_point svg_deadline_t;
+
+//SVG renders get threads of their own, so that a slow one can't hold up
+//decoding. The pool is never destroyed, since that would mean waiting for
+//renders that resvg has no way of interrupting.
+static QThreadPool &svg_pool(){
+	static auto ret = new QThreadPool;
+	return *ret;
+}
+
+//Runs f(deadline) on the SVG pool. f is expected to give up once the deadline
+//passes, but resvg can only be stopped between calls, so a render that's
+//still going by then also gives its thread back to the pool for as long as
+//it keeps running. That way renders queued behind it can go ahead.
+template <typename F>
+static auto run_svg_render(F &&f){
+	return QtConcurrent::run(&svg_pool(), [f = std::forward<F>(f)]() mutable{
+		enum{ running, done, overdue };
+		auto state = std::make_shared<std::atomic<int>>(running);
+		//The clock starts when the render does, not while it waits in the
+		//queue, and a render cancelled before it starts never arms it.
+		QTimer::singleShot(svg_render_deadline, qApp, [state](){
+			int expected = running;
+			if (state->compare_exchange_strong(expected, overdue))
+				svg_pool().releaseThread();
+		});
+		//Takes the thread back however f exits.
+		struct Finisher{
+			std::shared_ptr<std::atomic<int>> state;
+			~Finisher(){
+				if (this->state->exchange(done) == overdue)
+					svg_pool().reserveThread();
+			}
+		} finisher{ state };
+		return f(std::chrono::steady_clock::now() + std::chrono::milliseconds(svg_render_deadline));
+	});
 }
 
-SvgImage::SvgImage(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path){
+SvgImage::SvgImage(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path, const cancellation_flag_t &load_cancelled):
+		cancelled(std::make_shared<std::atomic<bool>>(false)),
+		view_cancelled(std::make_shared<std::atomic<bool>>(false)){
 	this->null = true;
 	this->alpha = true;
-	auto data = read_file(dev, path);
-	auto [error, tree] = ReSvgRenderTree::create_from_data(data.data(), data.size(), {});
-	if (error != ReSvgRenderTree::Error::NoError)
+	auto &cache = app.get_svg_cache();
+	auto key = app.get_file_identity(path);
+	this->document = cache.get(key);
+	if (!this->document){
+		this->document = SvgDocument::create(SvgDocument::read(std::move(dev), path), app.get_svg_options());
+		if (!this->document)
+			return;
+		this->document->cache_as(cache, key);
+	}
+	//Nobody wants the renders any more. The document stays cached.
+	if (is_cancelled(load_cancelled))
 		return;
-	this->tree = std::move(tree);
-	this->null = this->tree.is_empty();
+	this->null = this->document->is_empty();
 	if (this->null)
 		return;
-	auto [w, h] = this->tree.get_size_int();
-	this->size = { w, h };
-	this->image = QtConcurrent::run([this](){
-		QImage dst(this->size, QImage::Format_RGBA8888_Premultiplied);
-		this->tree.render(dst.bits());
-		return dst;
-	});
-	this->pixmap = QtConcurrent::run([this](){
-		return QPixmap::fromImage(this->image.result());
+	this->size = this->document->get_size();
+	bool preview = (qint64)this->size.width() * this->size.height() >= svg_preview_threshold ||
+		this->document->get_source_size() >= svg_preview_source_threshold;
+	if (preview){
+		auto scale = get_svg_preview_scale(this->size);
+		//The options are fetched in the background, since they wait for the
+		//fonts.
+		auto preview_image = run_svg_render([document = this->document, app = &app, scale, cancelled = this->cancelled](svg_deadline_t deadline){
+			return render_preview(document, app->get_svg_preview_options(), scale, cancelled, deadline);
+		});
+		this->preview = preview_image.then(QtFuture::Launch::Async, [](QImage image){
+			return QPixmap::fromImage(image);
+		});
+		//The preview is close enough to tell what the background should be.
+		this->background_color = this->preview.then([preview_image](QPixmap){
+			return background_color_parallel_function(preview_image.result());
+		});
+	}
+	this->image = run_svg_render([document = this->document, rect = QRect(QPoint(0, 0), this->size), cancelled = this->cancelled](svg_deadline_t deadline){
+		return render(document, rect, 1, cancelled, deadline);
 	});
-	this->background_color = QtConcurrent::run([this](){
-		return background_color_parallel_function(this->image.result());
+	//Each stage only gets scheduled once its input is ready, instead of
+	//holding up a pool thread waiting for it. A future can only have one
+	//continuation, so the background color follows the pixmap, by which time
+	//the image is ready.
+	this->pixmap = this->image.then(QtFuture::Launch::Async, [](QImage image){
+		return QPixmap::fromImage(image);
 	});
+	if (!preview){
+		this->background_color = this->pixmap.then([image = this->image](QPixmap){
+			return background_color_parallel_function(image.result());
+		});
+	}
 }
 
 SvgImage::~SvgImage(){
-	if (this->image.isStarted())
-		this->image.waitForFinished();
-	if (this->pixmap.isStarted())
-		this->pixmap.waitForFinished();
-	if (this->background_color.isStarted())
-		this->background_color.waitForFinished();
+	//Nothing in flight refers to this, so there's nothing to wait for. A
+	//render that's already running stops at the next band and its result is
+	//dropped, and the stages after it never start.
+	*this->cancelled = true;
+	*this->view_cancelled = true;
+	this->preview.cancel();
+	this->image.cancel();
+	this->pixmap.cancel();
+	this->background_color.cancel();
+	this->rendering.cancel();
+	this->region_rendering.cancel();
+}
+
+QImage SvgImage::render(const std::shared_ptr<SvgDocument> &document, const QRect &rect, double scale, const cancellation_flag_t &cancelled, svg_deadline_t deadline, const ReSvgRenderTree *tree){
+	auto give_up = [&cancelled, deadline](){
+		return is_cancelled(cancelled) || std::chrono::steady_clock::now() > deadline;
+	};
+	if (give_up())
+		return {};
+	QImage dst(rect.size(), QImage::Format_RGBA8888_Premultiplied);
+	dst.fill(Qt::transparent);
+	auto w = rect.width();
+	auto h = rect.height();
+	//Rows are contiguous, so each band is rendered straight into its part of
+	//the image.
+	auto bits = dst.bits();
+	auto stride = dst.bytesPerLine();
+	//Bands are where a render can be stopped.
+	int bands = std::max(h / min_svg_band_height, 1);
+	bool parallel = !tree && (qint64)w * h >= min_parallel_svg_render && bands > 1;
+	bands = std::min(bands, parallel ? svg_pool().maxThreadCount() * 2 : max_serial_svg_bands);
+	std::vector<std::pair<int, int>> ranges;
+	for (int i = 0; i < bands; i++)
+		ranges.emplace_back(h * i / bands, h * (i + 1) / bands);
+	auto render_band = [&document, bits, stride, rect, scale](const ReSvgRenderTree &tree, const std::pair<int, int> &band){
+		document->render(tree, bits + (qint64)band.first * stride, rect.width(), band.second - band.first, scale, rect.x(), rect.y() + band.first);
+	};
+	if (!parallel){
+		auto own = tree ? nullptr : document->acquire_tree(0);
+		for (auto &band : ranges){
+			if (give_up())
+				break;
+			render_band(tree ? *tree : *own, band);
+		}
+		if (own)
+			document->release_tree(std::move(own));
+	}else{
+		//One tree per thread that can work on the render at once.
+		auto max_trees = (size_t)std::max(svg_pool().maxThreadCount(), 1);
+		QtConcurrent::blockingMap(&svg_pool(), ranges, [&document, &give_up, &render_band, max_trees](const std::pair<int, int> &band){
+			if (give_up())
+				return;
+			auto tree = document->acquire_tree(max_trees);
+			render_band(*tree, band);
+			document->release_tree(std::move(tree));
+		});
+	}
+	if (give_up())
+		return {};
+	return dst;
+}
+
+QImage SvgImage::render_preview(const std::shared_ptr<SvgDocument> &document, const std::shared_ptr<const ReSvgOptions> &options, double scale, const cancellation_flag_t &cancelled, svg_deadline_t deadline){
+	if (is_cancelled(cancelled))
+		return {};
+	auto tree = document->parse(*options);
+	if (!tree)
+		return {};
+	auto size = document->get_size();
+	QRect rect(0, 0, std::max((int)ceil(size.width() * scale), 1), std::max((int)ceil(size.height() * scale), 1));
+	return render(document, rect, scale, cancelled, deadline, tree.get());
+}
+
+void SvgImage::watch_renders(){
+	if (this->watching_renders || this->null)
+		return;
+	this->watching_renders = true;
+	std::weak_ptr<LoadedGraphics> weak = this->shared_from_this();
+	auto finished = [weak](){
+		auto self = weak.lock();
+		if (self)
+			static_cast<SvgImage &>(*self).full_render_finished();
+	};
+	//Each future can only have one continuation. Without a preview, the
+	//background color is computed last, from the full render.
+	if (!this->preview.isValid()){
+		this->background_color.then(qApp, [finished](QColor){ finished(); });
+		return;
+	}
+	this->background_color.then(qApp, [weak](QColor){
+		auto self = weak.lock();
+		if (self)
+			static_cast<SvgImage &>(*self).notify_updated();
+	});
+	this->pixmap.then(qApp, [finished](QPixmap){ finished(); });
+}
+
+void SvgImage::full_render_finished(){
+	//Unless it was given up on.
+	this->full_render_done = !this->pixmap.result().isNull();
+	this->add_to_cache();
+	this->notify_updated();
+}
+
+QPixmap SvgImage::get_base_pixmap(){
+	this->watch_renders();
+	if (!this->scaled_render.isNull())
+		return this->scaled_render;
+	if (this->pixmap.isValid() && this->pixmap.isFinished()){
+		auto ret = this->pixmap.result();
+		if (!ret.isNull())
+			return ret;
+	}
+	//Shown until the full render is done, and instead of it if it was given
+	//up on.
+	if (this->preview.isValid() && this->preview.isFinished())
+		return this->preview.result();
+	return {};
+}
+
+QColor SvgImage::get_background_color(){
+	this->watch_renders();
+	if (this->background_color.isValid() && this->background_color.isFinished())
+		return this->background_color.result();
+	return Qt::white;
 }
 
 void SvgImage::assign_to_QLabel(QLabel &label){
-	label.setPixmap(this->pixmap.result());
+	label.setPixmap(this->get_base_pixmap());
+}
+
+double SvgImage::get_max_scale() const{
+	auto pixels = (double)this->size.width() * this->size.height();
+	return sqrt(max_svg_render / pixels);
+}
+
+void SvgImage::schedule_update(){
+	auto generation = ++this->refinement_generation;
+	std::weak_ptr<LoadedGraphics> weak = this->shared_from_this();
+	QTimer::singleShot(svg_refinement_delay, qApp, [weak, generation](){
+		auto self = weak.lock();
+		if (!self)
+			return;
+		auto &svg = static_cast<SvgImage &>(*self);
+		//The zoom or the view changed again in the meantime.
+		if (svg.refinement_generation == generation)
+			svg.update_render();
+	});
+}
+
+void SvgImage::request_refinement(double zoom){
+	if (this->null || zoom <= 0)
+		return;
+	this->zoom = zoom;
+	//Beyond this, the whole image is scaled up from the largest render
+	//allowed, and paint() renders the visible region on top of it.
+	this->wanted_scale = std::min(zoom, this->get_max_scale());
+	if (zoom <= this->get_max_scale()){
+		bool had_region = !this->region_render.isNull();
+		this->region_render = QPixmap();
+		this->region_scale = this->wanted_region_scale = 0;
+		if (had_region)
+			this->update_memory_usage();
+	}
+	this->schedule_update();
+}
+
+void SvgImage::no_longer_displayed(){
+	//Renders still in flight stop at the next band, and what they return is
+	//dropped. Later ones get a fresh flag.
+	*this->view_cancelled = true;
+	this->view_cancelled = std::make_shared<std::atomic<bool>>(false);
+	this->refinement_generation++;
+	this->zoom = 1;
+	this->wanted_scale = 1;
+	this->wanted_region = QRectF();
+	this->wanted_region_scale = 0;
+	this->scaled_render = QPixmap();
+	this->rendered_scale = 1;
+	this->region_render = QPixmap();
+	this->rendered_region = QRectF();
+	this->region_scale = 0;
+	this->update_memory_usage();
+}
+
+size_t SvgImage::get_memory_usage() const{
+	//Both the rendered QImage and its QPixmap are kept.
+	auto ret = LoadedGraphics::get_memory_usage() * 2;
+	if (this->preview.isValid()){
+		auto scale = get_svg_preview_scale(this->size);
+		ret += (size_t)ceil(this->size.width() * scale) * (size_t)ceil(this->size.height() * scale) * 4;
+	}
+	return ret + get_pixmap_memory_usage(this->scaled_render) + get_pixmap_memory_usage(this->region_render);
+}
+
+bool SvgImage::paint(QPainter &painter, const QRectF &visible, double zoom){
+	if (this->null)
+		return false;
+	QRectF image_rect(QPointF(0, 0), this->size);
+	auto base = this->get_base_pixmap();
+	painter.drawPixmap(image_rect, base, base.rect());
+	if (zoom <= this->get_max_scale() || visible.isEmpty())
+		return true;
+
+	if (!this->region_render.isNull() && this->region_scale == zoom)
+		painter.drawPixmap(this->rendered_region, this->region_render, this->region_render.rect());
+	bool covered = this->region_scale == zoom && this->rendered_region.contains(visible);
+	bool requested = this->wanted_region_scale == zoom && this->wanted_region.contains(visible);
+	if (covered || requested)
+		return true;
+	//Leave a margin around what's visible so that small pans don't need a
+	//new render. The region is aligned to the pixels it'll be rendered to.
+	auto dx = visible.width() * svg_region_margin;
+	auto dy = visible.height() * svg_region_margin;
+	auto region = visible.adjusted(-dx, -dy, dx, dy) & image_rect;
+	auto scaled = QRectF(region.topLeft() * zoom, region.size() * zoom).toAlignedRect();
+	this->wanted_region = QRectF(QPointF(scaled.topLeft()) / zoom, QSizeF(scaled.size()) / zoom);
+	this->wanted_region_scale = zoom;
+	this->schedule_update();
+	return true;
+}
+
+//Returns the pixels region covers in the image scaled by scale.
+static QRect to_pixels(const QRectF &region, double scale){
+	auto ret = QRectF(region.topLeft() * scale, region.size() * scale).toAlignedRect();
+	if (ret.isEmpty())
+		ret.setSize(QSize(1, 1));
+	return ret;
+}
+
+void SvgImage::start_render(const QRectF &region, double scale, bool whole){
+	auto rect = to_pixels(region, scale);
+	std::weak_ptr<LoadedGraphics> weak = this->shared_from_this();
+	this->render_in_progress = true;
+	auto document = this->document;
+	if (whole){
+		this->rendering = run_svg_render([document, rect, scale, cancelled = this->view_cancelled](svg_deadline_t deadline){
+			return QPixmap::fromImage(render(document, rect, scale, cancelled, deadline));
+		});
+		this->rendering.then(qApp, [weak, region, scale](QPixmap pixmap){
+			auto self = weak.lock();
+			if (self)
+				static_cast<SvgImage &>(*self).render_finished(region, scale, true, pixmap);
+		});
+		return;
+	}
+	//After a pan, whatever the last region render covers is kept, and only
+	//what's come into view is rendered.
+	QRect previous;
+	if (!this->region_render.isNull() && this->region_scale == scale)
+		previous = to_pixels(this->rendered_region, scale);
+	this->region_rendering = run_svg_render([document, rect, previous, scale, cancelled = this->view_cancelled](svg_deadline_t deadline){
+		RenderedParts ret;
+		for (auto &part : QRegion(rect).subtracted(previous))
+			ret.emplace_back(part, render(document, part, scale, cancelled, deadline));
+		return ret;
+	});
+	this->region_rendering.then(qApp, [weak, region, rect, previous, scale](RenderedParts parts){
+		auto self = weak.lock();
+		if (self)
+			static_cast<SvgImage &>(*self).region_render_finished(region, rect, previous, scale, parts);
+	});
+}
+
+void SvgImage::update_render(){
+	//Called again once the current render is done.
+	if (this->render_in_progress)
+		return;
+	QRectF image_rect(QPointF(0, 0), this->size);
+	auto scale = this->wanted_scale;
+	if (fabs(scale / this->rendered_scale - 1) >= 0.01){
+		if (scale == 1)
+			this->render_finished(image_rect, 1, true, {});
+		else
+			this->start_render(image_rect, scale, true);
+		return;
+	}
+	auto region_scale = this->wanted_region_scale;
+	if (region_scale > 0 && (region_scale != this->region_scale || this->wanted_region != this->rendered_region))
+		this->start_render(this->wanted_region, region_scale, false);
+}
+
+void SvgImage::render_finished(const QRectF &region, double scale, bool whole, const QPixmap &pixmap){
+	this->render_in_progress = false;
+	if (whole){
+		this->scaled_render = pixmap;
+		this->rendered_scale = scale;
+	}else if (scale == this->wanted_region_scale){
+		this->region_render = pixmap;
+		this->rendered_region = region;
+		this->region_scale = scale;
+	}
+	this->update_memory_usage();
+	this->notify_updated();
+	this->update_render();
+}
+
+void SvgImage::region_render_finished(const QRectF &region, const QRect &rect, const QRect &previous, double scale, const RenderedParts &parts){
+	//The render the missing parts were meant to come from may have been
+	//dropped in the meantime.
+	bool stale = !previous.isEmpty() && (this->region_render.isNull() || this->region_scale != scale || to_pixels(this->rendered_region, scale) != previous);
+	if (stale || scale != this->wanted_region_scale){
+		this->render_in_progress = false;
+		this->update_render();
+		return;
+	}
+	//Some of it was given up on, so it can't be passed off as covering the
+	//region. Whatever was there before stays, and the region is asked for
+	//again the next time it's painted.
+	for (auto &part : parts){
+		if (part.second.isNull()){
+			this->render_in_progress = false;
+			this->wanted_region_scale = 0;
+			this->update_render();
+			return;
+		}
+	}
+	QPixmap pixmap(rect.size());
+	pixmap.fill(Qt::transparent);
+	QPainter painter(&pixmap);
+	painter.setCompositionMode(QPainter::CompositionMode_Source);
+	auto overlap = rect & previous;
+	if (!overlap.isEmpty())
+		painter.drawPixmap(overlap.topLeft() - rect.topLeft(), this->region_render, overlap.translated(-previous.topLeft()));
+	for (auto &[part, image] : parts)
+		painter.drawImage(part.topLeft() - rect.topLeft(), image);
+	painter.end();
+	this->render_finished(region, scale, false, pixmap);
 }
 
 QImage SvgImage::get_QImage() const{
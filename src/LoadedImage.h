@@ -11,19 +11,47 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "config.hpp"
 #include "ImageViewerApplication.h"
 #include "resvg.hpp"
+#include "SvgDocument.h"
+#include "Streams.h"
 #include <QString>
 #include <QPixmap>
 #include <QMovie>
 #include <QFuture>
+#include <QPointer>
+#include <QRectF>
 #include <memory>
+#include <functional>
+#include <vector>
+#include <cstdint>
+#include <chrono>
 
 class QLabel;
+class QPainter;
 
-class LoadedGraphics{
+class LoadedGraphics : public std::enable_shared_from_this<LoadedGraphics>{
+	std::vector<std::pair<QPointer<QObject>, std::function<void()>>> listeners;
+	//Where create() put this, or where it goes once it becomes cacheable.
+	DecodedImageCache *cache = nullptr;
+	FileIdentity cache_key;
+
+	static std::shared_ptr<LoadedGraphics> create_uncached(ImageViewerApplication &app, const QString &path, const cancellation_flag_t &cancelled, const DecodeHint &hint, std::unique_ptr<QIODevice> &&dev);
 protected:
 	QSize size;
 	bool alpha;
 	bool null;
+
+	//Must be called from the GUI thread.
+	void notify_updated();
+	//Must be called whenever get_memory_usage() changes after construction,
+	//so that the decoded image cache charges for the new size.
+	void update_memory_usage();
+	//For graphics that only become cacheable after create() returns them.
+	//Must be called from the GUI thread.
+	void add_to_cache();
+	//Called from the GUI thread once the last listener is removed, i.e. when
+	//no window displays the graphics any more. Implementations can drop what
+	//they only keep for the current view.
+	virtual void no_longer_displayed(){}
 public:
 	virtual ~LoadedGraphics(){}
 	virtual bool is_animation() const = 0;
@@ -40,7 +68,43 @@ public:
 	}
 	virtual void assign_to_QLabel(QLabel &) = 0;
 	virtual QImage get_QImage() const = 0;
-	static std::shared_ptr<LoadedGraphics> create(ImageViewerApplication &app, const QString &path);
+	//Approximate number of bytes held by the decoded representation.
+	virtual size_t get_memory_usage() const{
+		return (size_t)this->size.width() * (size_t)this->size.height() * 4;
+	}
+	//Whether the object can be shared between windows through the decoded
+	//image cache.
+	virtual bool is_cacheable() const{
+		return true;
+	}
+	//Called from the GUI thread whenever the graphics are displayed at a new
+	//zoom level (in device pixels per image pixel). Implementations holding a
+	//reduced version may start producing a better one in the background, and
+	//notify their listeners once it's ready.
+	virtual void request_refinement(double){}
+	//Lets graphics that aren't held as a single pixmap paint themselves.
+	//painter is already transformed to image coordinates, visible is the part
+	//of the image that needs painting, and zoom is in device pixels per image
+	//pixel. Returns false to have the pixmap assigned to the label painted
+	//instead.
+	virtual bool paint(QPainter &, const QRectF &visible, double zoom){
+		return false;
+	}
+	//True if paint() decodes what's visible on demand, so its output must not
+	//be cached.
+	virtual bool paints_on_demand() const{
+		return false;
+	}
+	//Registers a callback to run in the GUI thread whenever the graphics
+	//change. It's dropped once owner is destroyed. Both functions must be
+	//called from the GUI thread.
+	void add_listener(QObject *owner, std::function<void()> &&callback);
+	void remove_listener(QObject *owner);
+	//If cancelled is given and gets raised while the image is being decoded,
+	//the decode is abandoned and the result is null. Raster images larger than
+	//hint calls for are decoded at a reduced size. If dev is given, the file is
+	//read from it instead of being opened.
+	static std::shared_ptr<LoadedGraphics> create(ImageViewerApplication &app, const QString &path, const cancellation_flag_t &cancelled = {}, const DecodeHint &hint = {}, std::unique_ptr<QIODevice> &&dev = nullptr);
 };
 
 class RasterGraphics : public LoadedGraphics{
@@ -54,11 +118,33 @@ public:
 class LoadedImage : public RasterGraphics{
 	QFuture<QPixmap> image;
 	QFuture<QColor> background_color;
+	QSize decoded_size;
+	//Set when the image can be decoded again at full resolution. Cleared if
+	//that fails, so that it's not tried on every zoom.
+	ImageViewerApplication *app = nullptr;
+	QString path;
+	bool refining = false;
+	//Raised to abandon the refinement in progress.
+	cancellation_flag_t refinement_cancelled;
+	//Successively halved versions of the image, used to paint it zoomed out.
+	//Built in the background the first time they're needed.
+	std::vector<QPixmap> mipmaps;
+	bool mipmaps_requested = false;
 
 	void compute_average_color(QImage);
+	void refinement_finished(const QPixmap &);
+	void build_mipmaps();
+protected:
+	QPixmap get_pixmap() const{
+		return this->image.result();
+	}
+	void no_longer_displayed() override;
 public:
-	LoadedImage(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path);
+	LoadedImage(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path, const cancellation_flag_t &cancelled = {}, const DecodeHint &hint = {}, const QByteArray &format = {});
 	LoadedImage(const QImage &image);
+	//Reduced-resolution stand-in for an image of size logical_size. It's
+	//scaled up when displayed.
+	LoadedImage(const QImage &image, const QSize &logical_size);
 	virtual ~LoadedImage();
 	QColor get_background_color() override{
 		return this->background_color.result();
@@ -68,14 +154,22 @@ public:
 	}
 	void assign_to_QLabel(QLabel &) override;
 	QImage get_QImage() const override;
+	size_t get_memory_usage() const override;
+	void request_refinement(double zoom) override;
+	bool paint(QPainter &, const QRectF &visible, double zoom) override;
 };
 
+//Can be loaded from any thread. QMovie must live in the GUI thread, so it's
+//only made once the animation is displayed, and the first frame stands in for
+//it until then.
 class LoadedAnimation : public RasterGraphics{
 	std::unique_ptr<QIODevice> device;
+	QByteArray format;
+	QImage first_frame;
 	std::unique_ptr<QMovie> animation;
 
 public:
-	LoadedAnimation(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path);
+	LoadedAnimation(std::unique_ptr<QIODevice> &&dev, const QByteArray &format = {});
 	QColor get_background_color() override{
 		return QColor(0, 0, 0, 0);
 	}
@@ -84,6 +178,9 @@ public:
 	}
 	void assign_to_QLabel(QLabel &) override;
 	QImage get_QImage() const override;
+	bool is_cacheable() const override{
+		return false;
+	}
 	std::unique_ptr<QIODevice> get_device(){
 		return std::move(this->device);
 	}
@@ -106,15 +203,83 @@ class SvgImage : public VectorGraphics{
 	QFuture<QImage> image;
 	QFuture<QPixmap> pixmap;
 	QFuture<QColor> background_color;
-	ReSvgRenderTree tree;
+	//Quick, lower quality render shown until the full one is done. Only made
+	//for SVGs that look slow to render.
+	QFuture<QPixmap> preview;
+	//Set once the renders above are watched for completion, which can only be
+	//done after construction.
+	bool watching_renders = false;
+	bool full_render_done = false;
+	std::shared_ptr<SvgDocument> document;
+	//Render at the scale the image is being displayed at, if it isn't 1. This
+	//and the region render are dropped once the image isn't displayed. Windows
+	//showing the same image share them, and the latest zoom requested wins.
+	QPixmap scaled_render;
+	double rendered_scale = 1;
+	double wanted_scale = 1;
+	//When the whole image at the current zoom would be too big to render,
+	//only the part around what's visible is.
+	QPixmap region_render;
+	QRectF rendered_region;
+	double region_scale = 0;
+	QRectF wanted_region;
+	double wanted_region_scale = 0;
+	double zoom = 1;
+	QFuture<QPixmap> rendering;
+	typedef std::vector<std::pair<QRect, QImage>> RenderedParts;
+	QFuture<RenderedParts> region_rendering;
+	bool render_in_progress = false;
+	std::uint64_t refinement_generation = 0;
+	//Set when this is destroyed, to stop the renders still going.
+	cancellation_flag_t cancelled;
+	//Same, for the renders at the current zoom, which are also stopped when
+	//the image stops being displayed.
+	cancellation_flag_t view_cancelled;
+
+	//Renders rect of the image scaled by scale, in bands that large renders
+	//render in parallel. Static so that renders hold their own reference to
+	//the document and never need to outlive this. Returns null if cancelled
+	//is set or the deadline passes before it's done. If tree is given, it's
+	//used for every band instead of the document's own trees.
+	static QImage render(const std::shared_ptr<SvgDocument> &, const QRect &rect, double scale, const cancellation_flag_t &cancelled, std::chrono::steady_clock::time_point deadline, const ReSvgRenderTree *tree = nullptr);
+	//Renders the whole image scaled by scale, with a tree parsed with options.
+	static QImage render_preview(const std::shared_ptr<SvgDocument> &, const std::shared_ptr<const ReSvgOptions> &options, double scale, const cancellation_flag_t &cancelled, std::chrono::steady_clock::time_point deadline);
+	void watch_renders();
+	void full_render_finished();
+	//Never waits. Returns a null pixmap if nothing has been rendered yet.
+	QPixmap get_base_pixmap();
+	double get_max_scale() const;
+	void schedule_update();
+	void update_render();
+	//region is in image coordinates. whole is set when region is the entire
+	//image.
+	void start_render(const QRectF &region, double scale, bool whole);
+	void render_finished(const QRectF &region, double scale, bool whole, const QPixmap &);
+	//rect is region in pixels. parts is what was rendered of it, the rest
+	//being the overlap with previous.
+	void region_render_finished(const QRectF &region, const QRect &rect, const QRect &previous, double scale, const RenderedParts &parts);
+protected:
+	void no_longer_displayed() override;
 public:
-	SvgImage(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path);
+	SvgImage(ImageViewerApplication &app, std::unique_ptr<QIODevice> &&dev, const QString &path, const cancellation_flag_t &cancelled = {});
 	~SvgImage();
-	QColor get_background_color() override{
-		return this->background_color.result();
+	//Never waits. Until the color is known, it's white, and listeners are
+	//notified once it is.
+	QColor get_background_color() override;
+	//Only once the full render is done. Until then, destroying this is what
+	//stops the render, which can't happen while it's in the cache.
+	bool is_cacheable() const override{
+		return this->full_render_done;
 	}
 	void assign_to_QLabel(QLabel &) override;
 	QImage get_QImage() const override;
+	size_t get_memory_usage() const override;
+	//Renders the image again at the new zoom level, once it stops changing.
+	void request_refinement(double zoom) override;
+	bool paint(QPainter &, const QRectF &visible, double zoom) override;
+	bool paints_on_demand() const override{
+		return this->zoom > this->get_max_scale();
+	}
 };
 
 #endif
@@ -14,17 +14,21 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include <QImage>
 #include <QMetaEnum>
 #include <QDir>
+#include <QTimer>
 #include <exception>
 #include <cassert>
 #include "GenericException.h"
+#include "ProtocolModule.h"
 
 MainWindow::MainWindow(ImageViewerApplication &app, const QStringList &arguments, QWidget *parent):
 		QMainWindow(parent),
 		ui(new Ui::MainWindow),
-		app(&app){
+		app(&app),
+		prefetcher(app),
+		loader(app, *this){
 	this->init(false);
 	if (arguments.size() >= 2)
-		this->open_path_and_display_image(arguments[1]);
+		this->open_path_async(arguments[1]);
 }
 
 TransparentMainWindow::TransparentMainWindow(ImageViewerApplication &app, const std::shared_ptr<WindowState> &state, QWidget *parent):
@@ -37,7 +41,9 @@ TransparentMainWindow::TransparentMainWindow(ImageViewerApplication &app, const
 MainWindow::MainWindow(ImageViewerApplication &app, const std::shared_ptr<WindowState> &state, QWidget *parent):
 		QMainWindow(parent),
 		ui(new Ui::MainWindow),
-		app(&app){
+		app(&app),
+		prefetcher(app),
+		loader(app, *this){
 	this->init(true);
 	this->restore_state(state);
 	this->set_background();
@@ -47,6 +53,11 @@ MainWindow::~MainWindow(){
 	this->cleanup();
 }
 
+//Navigations less than this many milliseconds apart are coalesced.
+static const int navigation_settle_time = 150;
+//How often prefetching checks whether the directory has been enumerated.
+static const int prefetch_retry_interval = 250;
+
 void MainWindow::init(bool restoring){
 	if (!this->window_state)
 		this->window_state = std::make_shared<WindowState>();
@@ -79,6 +90,14 @@ void MainWindow::init(bool restoring){
 	this->setup_shortcuts();
 
 	connect(this->ui->label, SIGNAL(transform_updated()), this, SLOT(label_transform_updated()));
+
+	this->navigation_timer.setSingleShot(true);
+	this->navigation_timer.setInterval(navigation_settle_time);
+	connect(&this->navigation_timer, &QTimer::timeout, this, [this](){ this->navigation_settled(); });
+
+	this->prefetch_retry_timer.setSingleShot(true);
+	this->prefetch_retry_timer.setInterval(prefetch_retry_interval);
+	connect(&this->prefetch_retry_timer, &QTimer::timeout, this, [this](){ this->prefetch_neighbors(); });
 }
 
 void MainWindow::set_current_desktop_and_fix_positions_by_window_position(std::string old_desktop){
@@ -293,7 +312,7 @@ void MainWindow::set_background_sizes(){
 
 void MainWindow::show_nothing(){
 	qDebug() << "MainWindow::show_nothing()";
-	this->displayed_image.reset();
+	this->set_displayed_image(nullptr);
 	this->resize(800, 600);
 	this->ui->label->move(0, 0);
 	this->ui->label->resize(this->size());
@@ -337,6 +356,10 @@ void MainWindow::advance(){
 }
 
 void MainWindow::set_iterator(){
+	//While a load is pending, the iterator already points at the file being
+	//loaded rather than at the one being displayed.
+	if (this->loader.is_loading() || this->navigation_pending)
+		return;
 	this->directory_iterator->advance_to(this->window_state->get_current_filename());
 }
 
@@ -374,46 +397,57 @@ void MainWindow::move_in_direction(bool forward){
 	if (this->directory_iterator->pos() == old_pos)
 		return;
 	this->clear_image_pos();
-	this->open_path_and_display_image(**this->directory_iterator);
+	this->schedule_open();
 	this->last_set_by_user = true;
 	this->app->save_settings();
 }
 
-class ElapsedTimer{
-	QString task;
-	clock_t t0;
-public:
-	ElapsedTimer(const QString &task): task(task){
-		qDebug() << "Task " << this->task << " started.";
-		this->t0 = clock();
+void MainWindow::schedule_open(){
+	auto path = **this->directory_iterator;
+	bool skipping = this->navigation_timer.isActive();
+	this->navigation_timer.start();
+	auto decoded = this->find_decoded(path);
+	if (decoded){
+		//Showing it costs nothing, so do it right away. Prefetching waits until
+		//the user settles.
+		this->loader.cancel();
+		this->set_busy(false);
+		this->navigation_pending = false;
+		this->finish_open(this->show_loaded_image(path, decoded));
+		return;
 	}
-	~ElapsedTimer(){
-		auto t1 = clock();
-		qDebug() << "Task " << this->task << " took " << (t1 - t0) / (double)CLOCKS_PER_SEC << " seconds.";
+	if (!skipping){
+		this->open_path_async(path);
+		return;
 	}
-};
+	//The user is still skipping. Abort whatever is being decoded, since it
+	//will never be shown, and only open the file they land on.
+	this->loader.cancel();
+	this->navigation_pending = true;
+	this->set_busy(true);
+}
 
-bool MainWindow::open_path_and_display_image(QString path){
-	ElapsedTimer et((QString)"open_path_and_display_image(" + path + ")");
-	std::shared_ptr<LoadedGraphics> li;
-	size_t i = 0;
-	auto &label = this->ui->label;
-	if (!!this->directory_iterator)
-		i = this->directory_iterator->pos();
-	while (true){
-		li = LoadedGraphics::create(*this->app, path);
-		qDebug() << path;
-		if (li && !li->is_null())
-			break;
-		if (!!this->directory_iterator){
-			this->advance();
-			if (this->directory_iterator->pos() == i)
-				break;
-			path = **this->directory_iterator;
-		}else
-			break;
+void MainWindow::navigation_settled(){
+	if (this->navigation_pending){
+		this->open_path_async(**this->directory_iterator);
+		return;
 	}
+	if (!this->loader.is_loading())
+		this->prefetch_neighbors();
+}
+
+std::shared_ptr<LoadedGraphics> MainWindow::find_decoded(const QString &path){
+	std::shared_ptr<LoadedGraphics> ret;
+	if (this->prefetcher.is_ready(path))
+		ret = this->prefetcher.take(path);
+	if (!ret)
+		ret = this->app->get_image_cache().get(this->app->get_file_identity(path));
+	return ret;
+}
 
+bool MainWindow::show_loaded_image(const QString &path, const std::shared_ptr<LoadedGraphics> &li){
+	auto &label = this->ui->label;
+	this->showing_preview = false;
 	QString current_filename;
 	QString window_title;
 
@@ -448,14 +482,14 @@ bool MainWindow::open_path_and_display_image(QString path){
 			this->directory_iterator = this->app->request_local_directory_iterator(current_directory);
 	}
 
-	if (li->is_null()){
+	if (!li || li->is_null()){
 		this->show_nothing();
 		return false;
 	}
 	this->color_calculated = false;
 	label->move(0, 0);
 	this->setWindowTitle(window_title);
-	this->displayed_image = li;
+	this->set_displayed_image(li);
 
 	label->reset_transform();
 	this->set_zoom();
@@ -464,16 +498,175 @@ bool MainWindow::open_path_and_display_image(QString path){
 	return true;
 }
 
-void MainWindow::display_filtered_image(const std::shared_ptr<LoadedGraphics> &graphics){
+void MainWindow::open_path_async(const QString &path, bool skipping){
+	this->navigation_pending = false;
+	if (!skipping && this->directory_iterator)
+		this->load_start_pos = this->directory_iterator->pos();
+	//Protocol modules aren't guaranteed to be reentrant, so URLs are read
+	//here and only decoded in the background. One that can't be opened is
+	//decoded from nothing, which fails like any other bad file.
+	QByteArray contents;
+	bool url = this->directory_iterator ? !this->directory_iterator->get_is_local() : CustomProtocolHandler::is_url(path);
+	if (url){
+		auto dev = this->app->open_file(path);
+		contents = dev ? dev->readAll() : QByteArray("");
+	}
+	this->loader.load(
+		path,
+		this->prefetcher.take_future(path),
+		this->get_decode_hint(),
+		[this, path](const std::shared_ptr<LoadedGraphics> &preview){ this->async_preview_ready(path, preview); },
+		[this, path](const std::shared_ptr<LoadedGraphics> &li){ this->async_load_finished(path, li); },
+		contents
+	);
+	this->set_busy(true);
+}
+
+void MainWindow::finish_open(bool success){
+	auto callback = std::move(this->on_opened);
+	this->on_opened = nullptr;
+	if (callback)
+		callback(success);
+	emit this->opened(this, success);
+}
+
+void MainWindow::async_preview_ready(const QString &path, const std::shared_ptr<LoadedGraphics> &preview){
+	//The preview has the logical size of the full image, so zoom and
+	//placement are computed as if it were the real thing.
+	if (!this->show_loaded_image(path, preview))
+		return;
+	this->showing_preview = true;
+	this->finish_open(true);
+}
+
+void MainWindow::async_load_finished(const QString &path, const std::shared_ptr<LoadedGraphics> &li){
+	this->set_busy(false);
+	if (!li){
+		if (!this->directory_iterator){
+			//The first file opened in this window. Show nothing, but do
+			//set up the directory it's in, so that it can be navigated.
+			this->show_loaded_image(path, nullptr);
+			this->finish_open(false);
+			return;
+		}
+		//Skip over files that can't be loaded.
+		this->advance();
+		if (this->directory_iterator->pos() != this->load_start_pos){
+			this->open_path_async(**this->directory_iterator, true);
+			return;
+		}
+		//Nothing else could be loaded either. Keep displaying what we had.
+		this->set_iterator();
+		this->finish_open(!this->is_null());
+		return;
+	}
+	if (this->showing_preview){
+		//Swap in the full resolution image without disturbing the position or
+		//zoom, which the user may have changed in the meantime.
+		this->showing_preview = false;
+		this->set_displayed_image(li);
+		this->ui->label->set_image(li);
+		this->ui->label->update();
+		if (this->color_calculated)
+			this->set_background(true);
+	}else if (!this->show_loaded_image(path, li)){
+		this->finish_open(false);
+		return;
+	}
+	this->finish_open(true);
+	this->app->save_settings();
+	this->prefetch_neighbors();
+}
+
+void MainWindow::set_busy(bool busy){
+	auto shape = this->cursor().shape();
+	if (busy && shape == Qt::ArrowCursor)
+		this->setCursor(Qt::BusyCursor);
+	else if (!busy && shape == Qt::BusyCursor)
+		this->setCursor(Qt::ArrowCursor);
+}
+
+DecodeHint MainWindow::get_decode_hint(){
+	DecodeHint ret;
+	auto &screen = this->current_desktop;
+	auto bounds = this->window_state->get_fullscreen() ? this->screen_sizes[screen].size() : this->desktop_sizes[screen].size();
+	bounds *= this->devicePixelRatioF();
+	switch (this->get_current_zoom_mode()){
+		case ZoomMode::AutoFit:
+			break;
+		case ZoomMode::AutoFill:
+			ret.mode = Qt::KeepAspectRatioByExpanding;
+			break;
+		case ZoomMode::AutoRotFit:
+			ret.any_orientation = true;
+			break;
+		case ZoomMode::AutoRotFill:
+			ret.mode = Qt::KeepAspectRatioByExpanding;
+			ret.any_orientation = true;
+			break;
+		default:
+			//The zoom doesn't depend on the size of the image, so the full
+			//resolution may be needed.
+			return ret;
+	}
+	ret.bounds = bounds;
+	return ret;
+}
+
+void MainWindow::set_displayed_image(const std::shared_ptr<LoadedGraphics> &graphics){
+	if (this->displayed_image == graphics)
+		return;
+	if (this->displayed_image)
+		this->displayed_image->remove_listener(this);
 	this->displayed_image = graphics;
+	if (!graphics)
+		return;
+	graphics->add_listener(this, [this](){
+		//A better version of the image is available.
+		this->ui->label->set_image(this->displayed_image);
+		this->ui->label->update();
+		//It may come with a better idea of the background color.
+		if (this->color_calculated)
+			this->set_background(true);
+	});
+}
+
+void MainWindow::prefetch_neighbors(){
+	//Protocol modules aren't guaranteed to be reentrant, so only local
+	//directories are prefetched.
+	if (!this->directory_iterator || !this->directory_iterator->get_is_local())
+		return;
+	if (!this->directory_iterator->get_listing()->is_ready()){
+		//Don't block on the directory enumeration. Try again once it's had a
+		//chance to finish. Calls in the meantime share the one retry, which
+		//prefetches around wherever the iterator is by then.
+		if (!this->prefetch_retry_timer.isActive())
+			this->prefetch_retry_timer.start();
+		return;
+	}
+	this->prefetch_retry_timer.stop();
+	this->set_iterator();
+	auto settings = this->app->get_option_values();
+	this->prefetcher.prefetch(
+		*this->directory_iterator,
+		this->moving_forward,
+		(size_t)std::max(settings->get_prefetch_ahead(), 0),
+		(size_t)std::max(settings->get_prefetch_behind(), 0),
+		this->get_decode_hint()
+	);
+}
+
+void MainWindow::display_filtered_image(const std::shared_ptr<LoadedGraphics> &graphics){
+	this->set_displayed_image(graphics);
 	this->display_image_in_label(graphics, false);
 }
 
 void MainWindow::display_image_in_label(const std::shared_ptr<LoadedGraphics> &graphics, bool first_display){
 	auto zoom = this->get_current_zoom();
 	auto &label = this->ui->label;
-	label->set_image(*graphics);
+	label->set_image(graphics);
 	label->set_zoom(zoom);
+	graphics->request_refinement(zoom * this->devicePixelRatioF());
 	auto size = label->get_size();
 	int mindim = std::min(size.width(), size.height());
 	this->window_state->set_border_size(
@@ -556,6 +749,10 @@ void MainWindow::contextMenuEvent(QContextMenuEvent *ev){
 //}
 
 void MainWindow::cleanup(){
+	this->navigation_timer.stop();
+	this->navigation_pending = false;
+	this->loader.cancel();
+	this->prefetcher.clear();
 	this->app->release_directory(this->directory_iterator);
 	this->directory_iterator.reset();
 }
@@ -13,11 +13,15 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include <QScreen>
 #include "LoadedImage.h"
 #include "DirectoryListing.h"
+#include "ImagePrefetcher.h"
+#include "ImageLoader.h"
 #include "ImageViewerApplication.h"
 #include <QStringList>
 #include <QShortcut>
+#include <QTimer>
 #include <vector>
 #include <memory>
+#include <functional>
 #include "Misc.h"
 #include "Settings.h"
 
@@ -65,6 +69,24 @@ protected:
 	bool color_calculated;
 	std::vector<QMetaObject::Connection> connections;
 	bool last_set_by_user = true;
+	ImagePrefetcher prefetcher;
+	ImageLoader loader;
+	//Iterator position at which the current asynchronous load started. Used
+	//to stop skipping unreadable files after going all the way around.
+	size_t load_start_pos = 0;
+	//Set while a reduced-resolution preview is being displayed.
+	bool showing_preview = false;
+	//Restarted on every navigation. While it's running the user is considered
+	//to be skipping through the directory.
+	QTimer navigation_timer;
+	//Set when the iterator has been moved to a file that hasn't been opened
+	//yet, because the user was still skipping.
+	bool navigation_pending = false;
+	//Runs while prefetching waits for the directory enumeration to finish.
+	QTimer prefetch_retry_timer;
+	//Called once the file being opened is displayed, or turns out it can't
+	//be, with whether anything is displayed.
+	std::function<void(bool)> on_opened;
 
 	enum class ResizeMode{
 		None        = 0,
@@ -99,6 +121,21 @@ protected:
 	bool force_keep_window_in_desktop();
 	void cleanup();
 	void move_in_direction(bool forward);
+	void prefetch_neighbors();
+	//Describes how big images will be displayed with the current zoom mode.
+	DecodeHint get_decode_hint();
+	void set_displayed_image(const std::shared_ptr<LoadedGraphics> &);
+	void schedule_open();
+	void navigation_settled();
+	//Returns the graphics for path if they can be had without decoding.
+	std::shared_ptr<LoadedGraphics> find_decoded(const QString &path);
+	void open_path_async(const QString &path, bool skipping = false);
+	void async_preview_ready(const QString &path, const std::shared_ptr<LoadedGraphics> &);
+	void async_load_finished(const QString &path, const std::shared_ptr<LoadedGraphics> &);
+	//Runs and clears on_opened.
+	void finish_open(bool success);
+	bool show_loaded_image(const QString &path, const std::shared_ptr<LoadedGraphics> &);
+	void set_busy(bool);
 	void advance();
 	void init(bool restoring);
 	void setup_shortcut(const QKeySequence &sequence, const char *slot);
@@ -148,7 +185,6 @@ public:
 	explicit MainWindow(ImageViewerApplication &app, const QStringList &arguments, QWidget *parent = 0);
 	explicit MainWindow(ImageViewerApplication &app, const std::shared_ptr<WindowState> &state, QWidget *parent = 0);
 	virtual ~MainWindow();
-	bool open_path_and_display_image(QString path);
 	void display_image_in_label(const std::shared_ptr<LoadedGraphics> &graphics, bool first_display);
 	void display_filtered_image(const std::shared_ptr<LoadedGraphics> &);
 	std::shared_ptr<WindowState> save_state() const;
@@ -180,6 +216,10 @@ public:
 	bool is_loaded() const{
 		return !!this->displayed_image;
 	}
+	//True while a file is being opened in the background.
+	bool is_opening() const{
+		return this->loader.is_loading();
+	}
 
 public slots:
 	void label_transform_updated();
@@ -221,6 +261,8 @@ public slots:
 
 signals:
 	void closing(MainWindow *);
+	//Emitted whenever a file finishes opening, successfully or not.
+	void opened(MainWindow *, bool success);
 
 };
 
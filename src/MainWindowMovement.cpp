@@ -68,7 +68,7 @@ bool MainWindow::set_cursor_flags(const MouseEvent &ev){
 	}
 	switch (rm){
 		case ResizeMode::None:
-			this->setCursor(Qt::ArrowCursor);
+			this->setCursor(this->loader.is_loading() || this->navigation_pending ? Qt::BusyCursor : Qt::ArrowCursor);
 			break;
 		case ResizeMode::Top:
 		case ResizeMode::Bottom:
@@ -24,23 +24,26 @@ void MainWindow::restore_state(const std::shared_ptr<WindowState> &state){
 
 	auto temp_zoom_mode = this->window_state->get_zoom_mode();
 	this->window_state->set_zoom_mode(ZoomMode::Locked);
-	bool success = this->open_path_and_display_image(path);
-	this->ui->label->load_state(*this->window_state);
-	this->window_state->set_zoom_mode(temp_zoom_mode);
+	//The rest has to wait for the image to be displayed.
+	this->on_opened = [this, temp_zoom_mode](bool success){
+		this->ui->label->load_state(*this->window_state);
+		this->window_state->set_zoom_mode(temp_zoom_mode);
 
-	auto pos = this->window_state->get_pos_u();
-	if (!(this->last_set_by_user = !!this->screen()->virtualSiblingAt(pos)))
-		pos = this->window_state->get_pos();
-	else
-		this->window_state->override_computed();
-	this->ui->label->move(this->window_state->get_label_pos());
-	this->move(pos);
-	this->current_desktop = unique_identifier(*this->screen());
-	this->window_rect.moveTopLeft(pos);
-	if (!success)
-		return;
-	this->resize(this->window_state->get_size());
-	this->fix_positions_and_zoom(true);
+		auto pos = this->window_state->get_pos_u();
+		if (!(this->last_set_by_user = !!this->screen()->virtualSiblingAt(pos)))
+			pos = this->window_state->get_pos();
+		else
+			this->window_state->override_computed();
+		this->ui->label->move(this->window_state->get_label_pos());
+		this->move(pos);
+		this->current_desktop = unique_identifier(*this->screen());
+		this->window_rect.moveTopLeft(pos);
+		if (!success)
+			return;
+		this->resize(this->window_state->get_size());
+		this->fix_positions_and_zoom(true);
+	};
+	this->open_path_async(path);
 }
 
 std::shared_ptr<WindowState> MainWindow::save_state() const{
@@ -209,7 +209,7 @@ void MainWindow::go_to_start(){
 	if (this->directory_iterator->pos() == i)
 		return;
 	this->moving_forward = true;
-	this->open_path_and_display_image(**this->directory_iterator);
+	this->open_path_async(**this->directory_iterator);
 }
 
 void MainWindow::go_to_end(){
@@ -221,7 +221,7 @@ void MainWindow::go_to_end(){
 	if (this->directory_iterator->pos() == i)
 		return;
 	this->moving_forward = false;
-	this->open_path_and_display_image(**this->directory_iterator);
+	this->open_path_async(**this->directory_iterator);
 }
 
 void MainWindow::toggle_fullscreen(){
@@ -218,6 +218,10 @@ void OptionsDialog::setup_general_options(){
 	this->ui->zoom_mode_for_new_windows_cb->set_selected_item(this->options->get_zoom_mode_for_new_windows());
 	this->ui->fullscreen_zoom_mode_for_new_windows_cb->set_selected_item(this->options->get_fullscreen_zoom_mode_for_new_windows());
 	this->ui->resize_windows_cb->setChecked(this->options->get_resize_windows_on_monitor_change());
+	this->ui->decoded_image_cache_size_spinbox->setValue(this->options->get_decoded_image_cache_size());
+	this->ui->background_color_tolerance_spinbox->setValue(this->options->get_background_color_tolerance());
+	this->ui->sort_mode_cb->setCurrentIndex((int)this->options->get_sort_mode());
+	this->ui->include_extensionless_files_cb->setChecked(this->options->get_include_extensionless_files());
 }
 
 void OptionsDialog::setup_signals(){
@@ -285,7 +289,8 @@ void OptionsDialog::item_inserted_into_shortcut_model(size_t index){
 }
 
 std::shared_ptr<MainSettings> OptionsDialog::build_options(){
-	auto ret = std::make_shared<MainSettings>();
+	//Start from the current values so settings that have no widget survive.
+	auto ret = std::make_shared<MainSettings>(*this->options);
 	ret->set_center_when_displayed(this->ui->center_when_displayed_cb->isChecked());
 	ret->set_use_checkerboard_pattern(this->ui->use_checkerboard_pattern_cb->isChecked());
 	ret->set_clamp_to_edges(this->ui->clamp_to_edges_cb->isChecked());
@@ -295,6 +300,10 @@ std::shared_ptr<MainSettings> OptionsDialog::build_options(){
 	ret->set_zoom_mode_for_new_windows(this->ui->zoom_mode_for_new_windows_cb->get_selected_item());
 	ret->set_fullscreen_zoom_mode_for_new_windows(this->ui->fullscreen_zoom_mode_for_new_windows_cb->get_selected_item());
 	ret->set_resize_windows_on_monitor_change(this->ui->resize_windows_cb->isChecked());
+	ret->set_decoded_image_cache_size(this->ui->decoded_image_cache_size_spinbox->value());
+	ret->set_background_color_tolerance(this->ui->background_color_tolerance_spinbox->value());
+	ret->set_sort_mode((SortMode)this->ui->sort_mode_cb->currentIndex());
+	ret->set_include_extensionless_files(this->ui->include_extensionless_files_cb->isChecked());
 	return ret;
 }
 
@@ -44,6 +44,12 @@ DEFINE_JSON_STRING(resize_windows_on_monitor_change);
 DEFINE_JSON_STRING(computed_position);
 DEFINE_JSON_STRING(user_set_position);
 DEFINE_JSON_STRING(last_set_by_user);
+DEFINE_JSON_STRING(prefetch_ahead);
+DEFINE_JSON_STRING(prefetch_behind);
+DEFINE_JSON_STRING(decoded_image_cache_size);
+DEFINE_JSON_STRING(background_color_tolerance);
+DEFINE_JSON_STRING(sort_mode);
+DEFINE_JSON_STRING(include_extensionless_files);
 
 template <typename T>
 struct json_cast{
@@ -255,6 +261,12 @@ MainSettings::MainSettings(const QJsonValueRef &json){
 	READ_JSON(keep_application_in_background, object);
 	READ_JSON(save_state_on_exit, object);
 	READ_JSON_DEFAULT(resize_windows_on_monitor_change, object, true);
+	READ_JSON_DEFAULT(prefetch_ahead, object, 2);
+	READ_JSON_DEFAULT(prefetch_behind, object, 1);
+	READ_JSON_DEFAULT(decoded_image_cache_size, object, 512);
+	READ_JSON_DEFAULT(background_color_tolerance, object, 1);
+	READ_JSON_DEFAULT(sort_mode, object, (int)SortMode::Name);
+	READ_JSON_DEFAULT(include_extensionless_files, object, false);
 }
 
 QJsonValue MainSettings::serialize() const{
@@ -268,6 +280,12 @@ QJsonValue MainSettings::serialize() const{
 	WRITE_JSON(keep_application_in_background, object);
 	WRITE_JSON(save_state_on_exit, object);
 	WRITE_JSON(resize_windows_on_monitor_change, object);
+	WRITE_JSON(prefetch_ahead, object);
+	WRITE_JSON(prefetch_behind, object);
+	WRITE_JSON(decoded_image_cache_size, object);
+	WRITE_JSON(background_color_tolerance, object);
+	WRITE_JSON(sort_mode, object);
+	WRITE_JSON(include_extensionless_files, object);
 	return object;
 }
 
@@ -405,6 +423,12 @@ bool MainSettings::operator==(const MainSettings &other) const{
 	CHECK_EQUALITY(keep_application_in_background);
 	CHECK_EQUALITY(save_state_on_exit);
 	CHECK_EQUALITY(resize_windows_on_monitor_change);
+	CHECK_EQUALITY(prefetch_ahead);
+	CHECK_EQUALITY(prefetch_behind);
+	CHECK_EQUALITY(decoded_image_cache_size);
+	CHECK_EQUALITY(background_color_tolerance);
+	CHECK_EQUALITY(sort_mode);
+	CHECK_EQUALITY(include_extensionless_files);
 	return true;
 }
 
@@ -121,6 +121,12 @@ class MainSettings : public Serializable{
 	bool keep_application_in_background;
 	bool save_state_on_exit;
 	bool resize_windows_on_monitor_change = true;
+	int prefetch_ahead = 2;
+	int prefetch_behind = 1;
+	int decoded_image_cache_size = 512;
+	int background_color_tolerance = 1;
+	int sort_mode = (int)SortMode::Name;
+	bool include_extensionless_files = false;
 
 public:
 	MainSettings();
@@ -134,6 +140,12 @@ public:
 	DEFINE_INLINE_SETTER_GETTER(keep_application_in_background)
 	DEFINE_INLINE_SETTER_GETTER(save_state_on_exit)
 	DEFINE_INLINE_SETTER_GETTER(resize_windows_on_monitor_change)
+	DEFINE_INLINE_SETTER_GETTER(prefetch_ahead)
+	DEFINE_INLINE_SETTER_GETTER(prefetch_behind)
+	DEFINE_INLINE_SETTER_GETTER(decoded_image_cache_size)
+	DEFINE_INLINE_SETTER_GETTER(background_color_tolerance)
+	DEFINE_ENUM_INLINE_SETTER_GETTER(SortMode, sort_mode)
+	DEFINE_INLINE_SETTER_GETTER(include_extensionless_files)
 	bool operator==(const MainSettings &other) const;
 	bool operator!=(const MainSettings &other) const{
 		return !(*this == other);
@@ -24,6 +24,14 @@ std::streamsize QFileInputStream::read(char *s, std::streamsize n){
 	return !ret && bad ? -1 : ret;
 }
 
+std::streamsize QIODeviceInputStream::read(char *s, std::streamsize n){
+	auto ret = this->device->read(s, n);
+	//Sequential devices may not have anything buffered yet.
+	while (!ret && !this->device->atEnd() && this->device->waitForReadyRead(-1))
+		ret = this->device->read(s, n);
+	return ret > 0 ? ret : -1;
+}
+
 std::streamsize QFileOutputStream::write(const char *s, std::streamsize n){
 	return this->file->write(s, n);
 }
@@ -36,3 +44,20 @@ std::streamsize MemoryStream::write(const char *s, std::streamsize n){
 	memcpy(&(*this->data)[m], s, n);
 	return n;
 }
+
+CancellableDevice::CancellableDevice(std::unique_ptr<QIODevice> &&inner, const cancellation_flag_t &cancelled):
+		inner(std::move(inner)),
+		cancelled(cancelled){
+	//Unbuffered, so that our position always matches the inner device's.
+	this->open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+qint64 CancellableDevice::readData(char *data, qint64 maxSize){
+	if (is_cancelled(this->cancelled))
+		return -1;
+	return this->inner->read(data, maxSize);
+}
+
+bool CancellableDevice::seek(qint64 pos){
+	return QIODevice::seek(pos) && this->inner->seek(pos);
+}
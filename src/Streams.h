@@ -9,8 +9,11 @@ Distributed under a permissive license. See COPYING.txt for details.
 #define STREAMS_H
 
 #include <boost/iostreams/stream.hpp>
+#include <QIODevice>
 #include <vector>
 #include <cstdint>
+#include <atomic>
+#include <memory>
 
 class QFile;
 
@@ -23,6 +26,15 @@ public:
 	std::streamsize read(char *s, std::streamsize n);
 };
 
+class QIODeviceInputStream{
+	QIODevice *device;
+public:
+	typedef char char_type;
+	typedef boost::iostreams::source_tag category;
+	QIODeviceInputStream(QIODevice *device): device(device){}
+	std::streamsize read(char *s, std::streamsize n);
+};
+
 class QFileOutputStream{
 	QFile *file;
 public:
@@ -42,5 +54,30 @@ public:
 	std::streamsize write(const char *s, std::streamsize n);
 };
 
+typedef std::shared_ptr<std::atomic<bool>> cancellation_flag_t;
+
+inline bool is_cancelled(const cancellation_flag_t &flag){
+	return flag && flag->load();
+}
+
+//Read-only device that stops returning data once its flag is raised, so that
+//a decoder reading from it fails early instead of running to completion.
+class CancellableDevice : public QIODevice{
+	std::unique_ptr<QIODevice> inner;
+	cancellation_flag_t cancelled;
+public:
+	CancellableDevice(std::unique_ptr<QIODevice> &&inner, const cancellation_flag_t &cancelled);
+	qint64 readData(char *data, qint64 maxSize) override;
+	qint64 writeData(const char *, qint64) override{
+		return -1;
+	}
+	bool isSequential() const override{
+		return this->inner->isSequential();
+	}
+	qint64 size() const override{
+		return this->inner->size();
+	}
+	bool seek(qint64 pos) override;
+};
 
 #endif
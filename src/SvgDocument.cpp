@@ -0,0 +1,259 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "SvgDocument.h"
+
+#ifdef ENABLE_SVG
+
+#include "Streams.h"
+#include <QFile>
+#include <QXmlStreamReader>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <algorithm>
+#include <set>
+
+//Assumed size of a parsed tree relative to its source.
+static const size_t tree_size_factor = 2;
+static const qint64 inflate_chunk_size = 1 << 16;
+//Larger sizes in gzip trailers aren't trusted for preallocation.
+static const qint64 max_inflate_size_hint = 1LL << 30;
+//resvg finds nodes by searching the entire tree, so documents with more top
+//level groups than this are rendered in one go.
+static const size_t max_layers = 64;
+
+static bool is_gzip(const QByteArray &header){
+	return header.size() >= 2 && (uchar)header[0] == 0x1F && (uchar)header[1] == 0x8B;
+}
+
+template <typename Source>
+static QByteArray inflate(const Source &source, qint64 size_hint){
+	boost::iostreams::filtering_istream stream;
+	stream.push(boost::iostreams::gzip_decompressor());
+	stream.push(source);
+	QByteArray ret;
+	//One more byte than expected, so that finding the end of the stream
+	//doesn't need the buffer to grow.
+	if (size_hint > 0 && size_hint <= max_inflate_size_hint)
+		ret.reserve(size_hint + 1);
+	qint64 size = 0;
+	try{
+		while (true){
+			//Fill what's reserved before growing past it.
+			qint64 n = ret.capacity() - size;
+			if (n <= 0)
+				n = inflate_chunk_size;
+			ret.resize(size + n);
+			stream.read(ret.data() + size, n);
+			auto count = stream.gcount();
+			size += count;
+			if (count < n)
+				break;
+		}
+	}catch (std::exception &){
+		return {};
+	}
+	if (stream.bad())
+		return {};
+	ret.resize(size);
+	//Only worth a copy if the hint was well off.
+	if (ret.capacity() - size > inflate_chunk_size)
+		ret.squeeze();
+	return ret;
+}
+
+QByteArray SvgDocument::read(std::unique_ptr<QIODevice> &&dev, const QString &path){
+	if (!dev){
+		auto file = std::make_unique<QFile>(path);
+		if (!file->open(QIODevice::ReadOnly))
+			return {};
+		dev = std::move(file);
+	}
+	if (!is_gzip(dev->peek(2)))
+		return dev->readAll();
+	auto file = qobject_cast<QFile *>(dev.get());
+	if (!file)
+		return inflate(QIODeviceInputStream(dev.get()), 0);
+	//The compressed data is only needed while it's being inflated, so it's
+	//mapped instead of read into memory.
+	auto size = file->size();
+	auto map = file->map(0, size);
+	if (!map)
+		return inflate(QIODeviceInputStream(file), 0);
+	//The trailer holds the inflated size, modulo 2^32.
+	qint64 size_hint = 0;
+	if (size >= 18){
+		auto p = map + size - 4;
+		size_hint = (quint32)p[0] | (quint32)p[1] << 8 | (quint32)p[2] << 16 | (quint32)p[3] << 24;
+	}
+	if (size_hint < size)
+		size_hint = 0;
+	return inflate(boost::iostreams::array_source((const char *)map, (size_t)size), size_hint);
+}
+
+//Returns the IDs of the top level groups, in order, if everything that's
+//drawn is in one of them and rendering them one after the other would give
+//the same result as rendering the whole document. That rules out effects
+//that reach past a group's bounding box, and stylesheets, which could add
+//such effects.
+static std::vector<std::string> find_layer_ids(const QByteArray &data){
+	static const std::set<QStringView> non_rendering = {
+		u"defs", u"title", u"desc", u"metadata", u"linearGradient", u"radialGradient",
+		u"pattern", u"clipPath", u"mask", u"filter", u"marker", u"symbol", u"script",
+	};
+	static const QStringView svg_namespace = u"http://www.w3.org/2000/svg";
+	auto has_effects = [](const QXmlStreamAttributes &attributes){
+		return attributes.hasAttribute("filter") || attributes.value("style").contains(u"filter");
+	};
+	QXmlStreamReader reader(data);
+	std::vector<std::string> ret;
+	std::set<std::string> seen;
+	int depth = 0;
+	while (!reader.atEnd()){
+		auto token = reader.readNext();
+		if (token == QXmlStreamReader::EndElement){
+			depth--;
+			continue;
+		}
+		if (token != QXmlStreamReader::StartElement)
+			continue;
+		depth++;
+		auto name = reader.name();
+		auto is_svg = reader.namespaceUri() == svg_namespace;
+		//A filter anywhere in a group can draw past the group's bounding
+		//box, so even one that's only defined is reason enough to give up.
+		if (is_svg && (name == u"style" || name == u"filter"))
+			return {};
+		auto attributes = reader.attributes();
+		if (has_effects(attributes))
+			return {};
+		if (depth == 1){
+			if (!is_svg || name != u"svg" || attributes.hasAttribute("opacity") || attributes.hasAttribute("mask") || attributes.hasAttribute("clip-path"))
+				return {};
+			continue;
+		}
+		//Elements from other namespaces aren't drawn.
+		if (depth != 2 || !is_svg || non_rendering.find(name) != non_rendering.end())
+			continue;
+		if (name != u"g" && name != u"use")
+			return {};
+		auto id = attributes.value("id").toString().toStdString();
+		if (id.empty() || !seen.insert(id).second)
+			return {};
+		ret.push_back(std::move(id));
+	}
+	if (reader.hasError() || ret.size() < 2 || ret.size() > max_layers)
+		return {};
+	return ret;
+}
+
+void SvgDocument::find_layers(const ReSvgRenderTree &tree){
+	auto [sx, sy, tx, ty] = tree.get_viewbox_transform();
+	for (auto &id : find_layer_ids(this->data)){
+		//Hidden and empty groups don't make it into the tree, but neither do
+		//ones the parser didn't understand, which could still draw something
+		//through another element. Either way, the layers can't be trusted to
+		//cover the document, so it's rendered whole.
+		auto bbox = tree.get_node_bounding_box(id.c_str());
+		if (!bbox){
+			this->layers.clear();
+			return;
+		}
+		auto [x, y, w, h] = *bbox;
+		this->layers.push_back({ std::move(id), QRectF(x * sx + tx, y * sy + ty, w * sx, h * sy) });
+	}
+}
+
+SvgDocument::SvgDocument(QByteArray &&data, const std::shared_ptr<const ReSvgOptions> &options, ReSvgRenderTree &&tree):
+		data(std::move(data)),
+		options(options){
+	this->empty = tree.is_empty();
+	if (!this->empty){
+		auto [w, h] = tree.get_size_int();
+		this->size = { w, h };
+		this->find_layers(tree);
+	}
+	this->idle_trees.push_back(std::make_unique<ReSvgRenderTree>(std::move(tree)));
+	this->tree_count = 1;
+}
+
+std::shared_ptr<SvgDocument> SvgDocument::create(QByteArray &&data, const std::shared_ptr<const ReSvgOptions> &options){
+	auto [error, tree] = ReSvgRenderTree::create_from_data(data.data(), data.size(), *options);
+	if (error != ReSvgRenderTree::Error::NoError)
+		return nullptr;
+	return std::make_shared<SvgDocument>(std::move(data), options, std::move(tree));
+}
+
+size_t SvgDocument::get_memory_usage() const{
+	std::lock_guard<std::mutex> lg(this->mutex);
+	return (size_t)this->data.size() * (1 + tree_size_factor * this->tree_count);
+}
+
+void SvgDocument::cache_as(SvgDocumentCache &cache, const FileIdentity &key){
+	this->cache = &cache;
+	this->cache_key = key;
+	cache.put(key, this->shared_from_this(), this->get_memory_usage());
+}
+
+std::unique_ptr<ReSvgRenderTree> SvgDocument::acquire_tree(size_t max_trees){
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while (this->idle_trees.empty()){
+		if (this->tree_count < max_trees){
+			this->tree_count++;
+			lock.unlock();
+			auto [error, tree] = ReSvgRenderTree::create_from_data(this->data.data(), this->data.size(), *this->options);
+			if (error == ReSvgRenderTree::Error::NoError){
+				if (this->cache)
+					this->cache->recharge(this->cache_key, this->shared_from_this(), this->get_memory_usage());
+				return std::make_unique<ReSvgRenderTree>(std::move(tree));
+			}
+			lock.lock();
+			this->tree_count--;
+			max_trees = 0;
+			continue;
+		}
+		this->tree_released.wait(lock);
+	}
+	auto ret = std::move(this->idle_trees.back());
+	this->idle_trees.pop_back();
+	return ret;
+}
+
+std::unique_ptr<ReSvgRenderTree> SvgDocument::parse(const ReSvgOptions &options) const{
+	auto [error, tree] = ReSvgRenderTree::create_from_data(this->data.data(), this->data.size(), options);
+	if (error != ReSvgRenderTree::Error::NoError)
+		return nullptr;
+	return std::make_unique<ReSvgRenderTree>(std::move(tree));
+}
+
+void SvgDocument::render(const ReSvgRenderTree &tree, void *dst, int w, int h, double scale, double x, double y) const{
+	QRectF target(x, y, w, h);
+	auto reaches = [&](const Layer &layer){
+		//Antialiasing can spill a pixel past the bounding box.
+		auto bounds = QRectF(layer.bounds.topLeft() * scale, layer.bounds.size() * scale);
+		return bounds.adjusted(-1, -1, 1, 1).intersects(target);
+	};
+	//Rendering the layers one by one only pays off when some can be skipped.
+	if (this->layers.empty() || std::all_of(this->layers.begin(), this->layers.end(), reaches)){
+		tree.render(dst, w, h, scale, x, y);
+		return;
+	}
+	for (auto &layer : this->layers)
+		if (reaches(layer))
+			tree.render_node(layer.id.c_str(), dst, w, h, scale, x, y);
+}
+
+void SvgDocument::release_tree(std::unique_ptr<ReSvgRenderTree> &&tree){
+	{
+		std::lock_guard<std::mutex> lg(this->mutex);
+		this->idle_trees.push_back(std::move(tree));
+	}
+	this->tree_released.notify_one();
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef SVGDOCUMENT_H
+#define SVGDOCUMENT_H
+
+#include "resvg.hpp"
+#include "ImageCache.h"
+
+#ifdef ENABLE_SVG
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+#include <QSize>
+#include <QRectF>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+//A parsed SVG file, shared by everything that displays it. A render tree
+//can't be rendered from two threads at once, so each concurrent render
+//borrows its own, parsed again from the source the first time it's needed.
+class SvgDocument : public std::enable_shared_from_this<SvgDocument>{
+	struct Layer{
+		std::string id;
+		//In image coordinates.
+		QRectF bounds;
+	};
+
+	QByteArray data;
+	std::shared_ptr<const ReSvgOptions> options;
+	QSize size;
+	bool empty;
+	mutable std::mutex mutex;
+	std::condition_variable tree_released;
+	std::vector<std::unique_ptr<ReSvgRenderTree>> idle_trees;
+	size_t tree_count = 0;
+	//Top level groups that can be rendered on their own. Empty if the
+	//document can't be split up like that.
+	std::vector<Layer> layers;
+	//Where cache_as() put this, if anywhere.
+	SvgDocumentCache *cache = nullptr;
+	FileIdentity cache_key;
+
+	void find_layers(const ReSvgRenderTree &);
+public:
+	SvgDocument(QByteArray &&data, const std::shared_ptr<const ReSvgOptions> &options, ReSvgRenderTree &&tree);
+	SvgDocument(const SvgDocument &) = delete;
+	SvgDocument &operator=(const SvgDocument &) = delete;
+	//Returns null if the data can't be parsed.
+	static std::shared_ptr<SvgDocument> create(QByteArray &&data, const std::shared_ptr<const ReSvgOptions> &options);
+	//Reads dev, or path if dev is null. Compressed (SVGZ) data is inflated
+	//here, straight into the returned buffer, so that resvg doesn't make
+	//another copy.
+	static QByteArray read(std::unique_ptr<QIODevice> &&dev, const QString &path);
+	QSize get_size() const{
+		return this->size;
+	}
+	bool is_empty() const{
+		return this->empty;
+	}
+	size_t get_source_size() const{
+		return this->data.size();
+	}
+	//resvg doesn't report how big its trees are, so this is a guess based on
+	//the size of the source and the number of trees parsed from it.
+	size_t get_memory_usage() const;
+	//Puts this in cache, and keeps what it's charged there up to date as
+	//more trees are parsed.
+	void cache_as(SvgDocumentCache &cache, const FileIdentity &key);
+	//Waits for a tree to become available, unless fewer than max_trees exist,
+	//in which case a new one is parsed. Trees must be given back with
+	//release_tree().
+	std::unique_ptr<ReSvgRenderTree> acquire_tree(size_t max_trees);
+	void release_tree(std::unique_ptr<ReSvgRenderTree> &&);
+	//Parses a tree with different options, which isn't pooled. Returns null
+	//on error.
+	std::unique_ptr<ReSvgRenderTree> parse(const ReSvgOptions &) const;
+	//Same as ReSvgRenderTree::render(), with a tree from acquire_tree(), but
+	//layers that don't reach the rendered region are skipped.
+	void render(const ReSvgRenderTree &, void *dst, int w, int h, double scale, double x, double y) const;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,160 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "TiledImage.h"
+#include <QImageReader>
+#include <QPainter>
+#include <QFile>
+#include <QCoreApplication>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrentRun>
+#include <algorithm>
+#include <cmath>
+
+//Images with more pixels than this are tiled.
+static const qint64 tiling_threshold = 64 << 20;
+//The overview is the first pyramid level that fits in a square this big.
+static const int overview_size = 2048;
+static const int tile_size = 512;
+static const size_t tile_cache_size = 128 << 20;
+
+static std::unique_ptr<QIODevice> open_cancellable(const QString &path, const cancellation_flag_t &cancelled){
+	auto file = std::make_unique<QFile>(path);
+	if (!file->open(QIODevice::ReadOnly))
+		return nullptr;
+	return std::make_unique<CancellableDevice>(std::move(file), cancelled);
+}
+
+static QSize level_size(const QSize &size, int level){
+	auto div = 1 << level;
+	return QSize((size.width() + div - 1) / div, (size.height() + div - 1) / div);
+}
+
+std::shared_ptr<TiledImage> TiledImage::create(QIODevice &dev, const QString &path, const QByteArray &format){
+	QImageReader reader(&dev, format);
+	auto size = reader.size();
+	if ((qint64)size.width() * size.height() < tiling_threshold)
+		return nullptr;
+	//Without this, every tile would require decoding the entire image.
+	if (!reader.supportsOption(QImageIOHandler::ClipRect))
+		return nullptr;
+	int level = 0;
+	for (auto s = size; std::max(s.width(), s.height()) > overview_size; s = level_size(size, ++level));
+	reader.setScaledSize(level_size(size, level));
+	auto overview = reader.read();
+	if (overview.isNull())
+		return nullptr;
+	return std::make_shared<TiledImage>(path, overview, size, level);
+}
+
+TiledImage::TiledImage(const QString &path, const QImage &overview, const QSize &full_size, int overview_level):
+		LoadedImage(overview, full_size),
+		path(path),
+		overview_level(overview_level),
+		tiles(tile_cache_size),
+		cancelled(std::make_shared<std::atomic<bool>>(false)){}
+
+TiledImage::~TiledImage(){
+	*this->cancelled = true;
+}
+
+size_t TiledImage::get_memory_usage() const{
+	return LoadedImage::get_memory_usage() + this->tiles.get_used();
+}
+
+void TiledImage::no_longer_displayed(){
+	LoadedImage::no_longer_displayed();
+	//Tiles only serve the current view. Those still being decoded are
+	//abandoned, and later ones get a fresh flag.
+	*this->cancelled = true;
+	this->cancelled = std::make_shared<std::atomic<bool>>(false);
+	this->pending.clear();
+	this->tiles.clear();
+	this->update_memory_usage();
+}
+
+QSize TiledImage::get_level_size(int level) const{
+	return level_size(this->size, level);
+}
+
+QRect TiledImage::get_tile_rect(const TileKey &key) const{
+	QRect ret(key.x * tile_size, key.y * tile_size, tile_size, tile_size);
+	return ret & QRect(QPoint(0, 0), this->get_level_size(key.level));
+}
+
+QRect TiledImage::get_source_rect(const TileKey &key) const{
+	auto rect = this->get_tile_rect(key);
+	auto scale = 1 << key.level;
+	QRect ret(rect.topLeft() * scale, rect.size() * scale);
+	return ret & QRect(QPoint(0, 0), this->size);
+}
+
+void TiledImage::request_tile(const TileKey &key){
+	this->pending.insert(key);
+	std::weak_ptr<LoadedGraphics> weak = this->shared_from_this();
+	auto path = this->path;
+	auto cancelled = this->cancelled;
+	auto source = this->get_source_rect(key);
+	auto dst_size = this->get_tile_rect(key).size();
+	QtConcurrent::run([path, cancelled, source, dst_size](){
+		auto dev = open_cancellable(path, cancelled);
+		if (!dev)
+			return QPixmap();
+		QImageReader reader(dev.get());
+		reader.setClipRect(source);
+		if (dst_size != source.size())
+			reader.setScaledSize(dst_size);
+		return QPixmap::fromImage(reader.read());
+	}).then(qApp, [weak, cancelled, key](QPixmap pixmap){
+		auto self = weak.lock();
+		if (self && !*cancelled)
+			static_cast<TiledImage &>(*self).tile_finished(key, pixmap);
+	});
+}
+
+void TiledImage::tile_finished(const TileKey &key, const QPixmap &pixmap){
+	this->pending.erase(key);
+	if (pixmap.isNull())
+		return;
+	//May evict older tiles as well.
+	this->tiles.put(key, pixmap, (size_t)pixmap.width() * pixmap.height() * 4);
+	this->update_memory_usage();
+	this->notify_updated();
+}
+
+bool TiledImage::paint(QPainter &painter, const QRectF &visible, double zoom){
+	int level = 0;
+	if (zoom < 1)
+		level = (int)floor(log2(1 / zoom));
+	if (level >= this->overview_level)
+		return LoadedImage::paint(painter, visible, zoom);
+
+	QRectF image_rect(QPointF(0, 0), this->size);
+	//Covers whatever isn't available at the right level yet.
+	auto overview = this->get_pixmap();
+	painter.drawPixmap(image_rect, overview, overview.rect());
+
+	auto scale = 1 << level;
+	auto level_visible = QRectF(visible.topLeft() / scale, visible.size() / scale).toAlignedRect();
+	level_visible &= QRect(QPoint(0, 0), this->get_level_size(level));
+	if (level_visible.isEmpty())
+		return true;
+	//Don't queue up more work than can be done at once. Tiles that are left
+	//out get requested by the repaint that follows each completed tile.
+	auto max_pending = (size_t)std::max(QThreadPool::globalInstance()->maxThreadCount(), 1) * 2;
+	for (int y = level_visible.top() / tile_size; y <= level_visible.bottom() / tile_size; y++){
+		for (int x = level_visible.left() / tile_size; x <= level_visible.right() / tile_size; x++){
+			TileKey key{ level, x, y };
+			auto tile = this->tiles.get(key);
+			if (!tile.isNull())
+				painter.drawPixmap(QRectF(this->get_source_rect(key)), tile, tile.rect());
+			else if (this->pending.find(key) == this->pending.end() && this->pending.size() < max_pending)
+				this->request_tile(key);
+		}
+	}
+	return true;
+}
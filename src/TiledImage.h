@@ -0,0 +1,59 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef TILEDIMAGE_H
+#define TILEDIMAGE_H
+
+#include "LoadedImage.h"
+#include "ImageCache.h"
+#include <QRect>
+#include <set>
+#include <tuple>
+
+struct TileKey{
+	int level;
+	int x;
+	int y;
+
+	bool operator<(const TileKey &other) const{
+		return std::tie(this->level, this->x, this->y) < std::tie(other.level, other.x, other.y);
+	}
+};
+
+//Image too large to keep decoded in full. Only a low resolution overview is
+//kept permanently. The regions actually being looked at are decoded on demand
+//as tiles of a pyramid whose level n is the image scaled by 1/2^n, and are
+//kept in an LRU cache of bounded size.
+class TiledImage : public LoadedImage{
+	QString path;
+	int overview_level;
+	ByteBudgetCache<TileKey, QPixmap> tiles;
+	std::set<TileKey> pending;
+	cancellation_flag_t cancelled;
+
+	QSize get_level_size(int level) const;
+	QRect get_tile_rect(const TileKey &) const;
+	QRect get_source_rect(const TileKey &) const;
+	void request_tile(const TileKey &);
+	void tile_finished(const TileKey &, const QPixmap &);
+protected:
+	void no_longer_displayed() override;
+public:
+	TiledImage(const QString &path, const QImage &overview, const QSize &full_size, int overview_level);
+	~TiledImage();
+	//Returns null if the image is small enough to be decoded normally, or if
+	//its format can't decode regions. Either way, dev has to be rewound before
+	//it's read again.
+	static std::shared_ptr<TiledImage> create(QIODevice &dev, const QString &path, const QByteArray &format);
+	size_t get_memory_usage() const override;
+	bool paint(QPainter &, const QRectF &visible, double zoom) override;
+	bool paints_on_demand() const override{
+		return true;
+	}
+};
+
+#endif
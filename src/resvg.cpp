@@ -9,6 +9,7 @@ Distributed under a permissive license. See COPYING.txt for details.
 #ifdef ENABLE_SVG
 #include <resvg.h>
 #include <cmath>
+#include <algorithm>
 
 #if defined _MSC_VER && (defined WIN32 || defined WIN64)
 #ifdef _DEBUG
@@ -151,6 +152,13 @@ void ReSvgOptions::load_system_fonts(){
 	resvg_options_load_system_fonts(this->options);
 }
 
+void ReSvgOptions::copy_fonts(const ReSvgOptions &other){
+	ENSURE_VALID_OPTIONS;
+	if (!other.options)
+		throw std::exception();
+	resvg_options_copy_fonts(this->options, other.options);
+}
+
 ReSvgRenderTree::~ReSvgRenderTree(){
 	if (this->tree)
 		resvg_tree_destroy(this->tree);
@@ -229,6 +237,30 @@ std::optional<std::tuple<double, double, double, double>> ReSvgRenderTree::get_b
 	return {{ x, y, w, h }};
 }
 
+std::optional<std::tuple<double, double, double, double>> ReSvgRenderTree::get_node_bounding_box(const char *id) const{
+	ENSURE_VALID_TREE;
+	resvg_path_bbox ret;
+	if (!resvg_get_node_bbox(this->tree, id, &ret))
+		return {};
+	auto [x, y, w, h] = ret;
+	return {{ x, y, w, h }};
+}
+
+//Same as usvg's view_box_to_transform() with xMidYMid meet. resvg renders
+//to a canvas of the rounded size.
+static std::tuple<double, double, double, double> fit_view_box(double x, double y, double w, double h, double width, double height){
+	width = std::max(1.0, round(width));
+	height = std::max(1.0, round(height));
+	auto s = std::min(width / w, height / h);
+	return { s, s, -x * s + (width - w * s) / 2, -y * s + (height - h * s) / 2 };
+}
+
+std::tuple<double, double, double, double> ReSvgRenderTree::get_viewbox_transform() const{
+	auto [x, y, w, h] = this->get_viewbox();
+	auto [width, height] = this->get_size();
+	return fit_view_box(x, y, w, h, width, height);
+}
+
 std::tuple<int, int, std::vector<std::uint8_t>> ReSvgRenderTree::render() const{
 	ENSURE_VALID_TREE;
 	auto [w, h] = this->get_size_int();
@@ -242,4 +274,32 @@ void ReSvgRenderTree::render(void *dst) const{
 	resvg_render(this->tree, { RESVG_FIT_TO_TYPE_ORIGINAL, 1 }, resvg_transform_identity(), w, h, (char *)dst);
 }
 
+void ReSvgRenderTree::render(void *dst, int w, int h, double scale, double x, double y) const{
+	ENSURE_VALID_TREE;
+	resvg_transform transform = { scale, 0, 0, scale, -x, -y };
+	resvg_render(this->tree, { RESVG_FIT_TO_TYPE_ORIGINAL, 1 }, transform, w, h, (char *)dst);
+}
+
+bool ReSvgRenderTree::render_node(const char *id, void *dst, int w, int h, double scale, double x, double y) const{
+	auto bbox = this->get_node_bounding_box(id);
+	if (!bbox)
+		return false;
+	auto [bx, by, bw, bh] = *bbox;
+	if (bw <= 0 || bh <= 0)
+		return false;
+	//resvg maps the node's bounding box to a canvas of its size in place of
+	//the viewbox transform, so that's undone before applying the latter.
+	auto [nsx, nsy, ntx, nty] = fit_view_box(bx, by, bw, bh, bw, bh);
+	auto [vsx, vsy, vtx, vty] = this->get_viewbox_transform();
+	resvg_transform transform = {
+		scale * vsx / nsx,
+		0,
+		0,
+		scale * vsy / nsy,
+		scale * (vtx - vsx * ntx / nsx) - x,
+		scale * (vty - vsy * nty / nsy) - y,
+	};
+	return resvg_render_node(this->tree, id, { RESVG_FIT_TO_TYPE_ORIGINAL, 1 }, transform, w, h, (char *)dst);
+}
+
 #endif
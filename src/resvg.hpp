@@ -66,6 +66,8 @@ public:
 	void load_font_data(const char *data, uintptr_t len);
 	std::int32_t load_font_file(const char *file_path);
 	void load_system_fonts();
+	//Replaces the loaded fonts with the ones loaded into other.
+	void copy_fonts(const ReSvgOptions &other);
 };
 
 class ReSvgRenderTree{
@@ -106,9 +108,23 @@ public:
 	std::pair<int, int> get_size_int() const;
 	std::tuple<double, double, double, double> get_viewbox() const;
 	std::optional<std::tuple<double, double, double, double>> get_bounding_box() const;
+	//In the same coordinates as get_bounding_box(). id must be a non-empty
+	//UTF-8 string.
+	std::optional<std::tuple<double, double, double, double>> get_node_bounding_box(const char *id) const;
+	//Scale and translation [sx, sy, tx, ty] from the viewbox's coordinates to
+	//the image's. Assumes the default preserveAspectRatio, which only matters
+	//when the viewbox's aspect ratio doesn't match the image's.
+	std::tuple<double, double, double, double> get_viewbox_transform() const;
 	std::tuple<int, int, std::vector<std::uint8_t>> render() const;
 	//dst MUST point to a portion of writeable memory >= w * h * 4, where [w, h] = get_size_int().
 	void render(void *dst) const;
+	//Renders the w * h region whose top left corner is (x, y) of the image
+	//scaled by scale. dst MUST be zeroed.
+	void render(void *dst, int w, int h, double scale, double x = 0, double y = 0) const;
+	//Like the above, but only draws the node with the given id, over whatever
+	//dst already holds. Returns false if there's no such node or it has no
+	//area.
+	bool render_node(const char *id, void *dst, int w, int h, double scale, double x = 0, double y = 0) const;
 };
 
 #endif